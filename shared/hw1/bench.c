@@ -0,0 +1,197 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "linux/mpi_api.h"
+
+// Number of timed sends per registry size
+#define BENCH_ITERATIONS 10000
+// Number of sends issued by every sender in the throughput benchmark
+#define BENCH_SENDS_PER_SENDER 20000
+// Largest number of concurrent senders in the throughput benchmark
+#define BENCH_MAX_SENDERS 16
+// Payload size of every benchmark message
+#define BENCH_MESSAGE_SIZE 64
+
+// Explicitly declare the syscall function prototype
+long syscall(long number, ...);
+
+// Registry sizes to measure at
+static const int registry_sizes[] = { 10, 100, 1000, 10000 };
+
+// Children kept alive (and registered) for the duration of the benchmark
+static pid_t children[10000];
+static int nr_children = 0;
+
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+// Grow the registry to 'target' processes. Each child registers itself and
+// then blocks on the pipe until the parent closes it, so its PID stays taken.
+static int grow_registry(int target, int hold[2], int ready[2]) {
+    char c;
+
+    while (nr_children + 1 < target) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork failed");
+            return -1;
+        }
+        if (pid == 0) {
+            close(hold[1]);
+            syscall(SYS_mpi_register);
+            write(ready[1], "r", 1);
+            read(hold[0], &c, 1);
+            _exit(0);
+        }
+        children[nr_children++] = pid;
+        // Wait for the child to finish registering
+        if (read(ready[0], &c, 1) != 1) {
+            perror("read failed");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Measure send latency to ourselves while the registry grows
+static int bench_registry(void) {
+    char buffer[BENCH_MESSAGE_SIZE] = { 0 };
+    int hold[2], ready[2];
+    struct timespec start, end;
+    unsigned int i, j;
+    pid_t self = getpid();
+
+    if (pipe(hold) || pipe(ready)) {
+        perror("pipe failed");
+        return -1;
+    }
+
+    printf("%10s %16s\n", "processes", "send latency ns");
+    for (i = 0; i < sizeof(registry_sizes) / sizeof(registry_sizes[0]); i++) {
+        if (grow_registry(registry_sizes[i], hold, ready))
+            break;
+
+        // Time sends to ourselves, then drain them untimed
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (j = 0; j < BENCH_ITERATIONS; j++) {
+            if (syscall(SYS_mpi_send, self, buffer, BENCH_MESSAGE_SIZE) == -1) {
+                perror("mpi_send failed");
+                return -1;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        for (j = 0; j < BENCH_ITERATIONS; j++)
+            syscall(SYS_mpi_receive, self, buffer, BENCH_MESSAGE_SIZE);
+
+        printf("%10d %16.1f\n", nr_children + 1, elapsed_ns(&start, &end) / BENCH_ITERATIONS);
+    }
+
+    // Release and reap all children
+    close(hold[1]);
+    close(hold[0]);
+    close(ready[0]);
+    close(ready[1]);
+    for (i = 0; i < (unsigned int)nr_children; i++)
+        waitpid(children[i], NULL, 0);
+    nr_children = 0;
+
+    return 0;
+}
+
+// Measure aggregate send throughput into our queue with 1, 2, 4, ... concurrent
+// sender processes, up to one per online CPU
+static int bench_throughput(void) {
+    char buffer[BENCH_MESSAGE_SIZE] = { 0 };
+    pid_t senders[BENCH_MAX_SENDERS];
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    struct timespec start, end;
+    int go[2];
+    int nr_senders, i, j;
+    int status, failed = 0;
+    char c;
+    pid_t self = getpid();
+
+    if (nr_cpus < 1)
+        nr_cpus = 1;
+
+    printf("%10s %16s\n", "senders", "sends per second");
+    for (nr_senders = 1; nr_senders <= nr_cpus && nr_senders <= BENCH_MAX_SENDERS; nr_senders *= 2) {
+        if (pipe(go)) {
+            perror("pipe failed");
+            return -1;
+        }
+
+        // Start all senders blocked on the go pipe
+        for (i = 0; i < nr_senders; i++) {
+            senders[i] = fork();
+            if (senders[i] < 0) {
+                perror("fork failed");
+                return -1;
+            }
+            if (senders[i] == 0) {
+                close(go[1]);
+                read(go[0], &c, 1);
+                for (j = 0; j < BENCH_SENDS_PER_SENDER; j++) {
+                    if (syscall(SYS_mpi_send, self, buffer, BENCH_MESSAGE_SIZE) == -1) {
+                        perror("mpi_send failed");
+                        _exit(1);
+                    }
+                }
+                _exit(0);
+            }
+        }
+
+        // Release them all at once and wait until every send completed
+        close(go[0]);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        close(go[1]);
+        for (i = 0; i < nr_senders; i++) {
+            waitpid(senders[i], &status, 0);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                failed = 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        // Drain the queue untimed
+        for (i = 0; i < nr_senders; i++)
+            while (syscall(SYS_mpi_receive, senders[i], buffer, BENCH_MESSAGE_SIZE) != -1)
+                ;
+
+        // A rate over partly failed sends would be meaningless
+        if (failed) {
+            fprintf(stderr, "a sender failed with %d senders\n", nr_senders);
+            return -1;
+        }
+        printf("%10d %16.0f\n", nr_senders,
+               nr_senders * (double)BENCH_SENDS_PER_SENDER * 1e9 / elapsed_ns(&start, &end));
+    }
+
+    return 0;
+}
+
+int main() {
+    struct mpi_quota quota = { 0 };
+
+    if (syscall(SYS_mpi_register) == -1) {
+        perror("mpi_register failed");
+        return 1;
+    }
+    // The throughput run queues up to 16 * 20000 messages at once, past the
+    // default byte limit; lift every limit so no send fails with EAGAIN
+    if (syscall(SYS_mpi_quota, &quota, NULL) == -1) {
+        perror("mpi_quota failed");
+        return 1;
+    }
+
+    if (bench_registry() || bench_throughput())
+        return 1;
+
+    return 0;
+}
@@ -1,3 +1,7 @@
 .long SYMBOL_NAME(sys_mpi_register)
 .long SYMBOL_NAME(sys_mpi_send)
 .long SYMBOL_NAME(sys_mpi_receive)
+.long SYMBOL_NAME(sys_mpi_receive_wait)
+.long SYMBOL_NAME(sys_mpi_quota)
+.long SYMBOL_NAME(sys_mpi_probe)
+.long SYMBOL_NAME(sys_mpi_register_ex)
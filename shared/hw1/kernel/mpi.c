@@ -1,192 +1,823 @@
 #include <linux/kernel.h>
+#include <linux/init.h>
 #include <linux/syscalls.h>
 #include <linux/slab.h>
+#include <linux/string.h>
 #include <linux/uaccess.h>
 #include <linux/list.h>
+#include <linux/rculist.h>
+#include <linux/hash.h>
 #include <linux/spinlock.h>
 #include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
 #include <linux/pid.h>
 #include <linux/errno.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 
-// Structure to represent a message in the MPI system
+// Narration of the MPI system calls; printk takes the console lock on every
+// call, so it is only compiled in with CONFIG_MPI_TRACE
+#ifdef CONFIG_MPI_TRACE
+#define MPI_TRACE(fmt, ...) printk(fmt, ##__VA_ARGS__)
+#else
+#define MPI_TRACE(fmt, ...) no_printk(fmt, ##__VA_ARGS__)
+#endif
+
+// Number of buckets in the PID-keyed process registry (log2)
+#define MPI_HASH_BITS 10
+#define MPI_HASH_SIZE (1 << MPI_HASH_BITS)
+
+// Number of per-sender queue buckets in each registered process (log2)
+#define MPI_SENDER_HASH_BITS 4
+#define MPI_SENDER_HASH_SIZE (1 << MPI_SENDER_HASH_BITS)
+
+// Largest payload served from the small-message cache
+#define MPI_SMALL_MESSAGE_SIZE 256
+
+// Byte limit on the messages queued for a process when it registers
+#define MPI_DEFAULT_MAX_BYTES (16 * 1024 * 1024)
+
+// Our sends to a full receiver sleep instead of failing with -EAGAIN
+#define MPI_QUOTA_BLOCK 1
+
+// Register the whole thread group under its TGID, see mpi_register_ex
+#define MPI_REGISTER_TGID 1
+
+// Limits on the messages queued for a process, as passed to mpi_quota;
+// a limit of 0 means unlimited
+struct mpi_quota {
+    int max_msgs;              // Messages queued for the process
+    int max_bytes;             // Payload bytes queued for the process
+    int max_pair_msgs;         // Same two limits, per sender
+    int max_pair_bytes;
+    int flags;                 // MPI_QUOTA_BLOCK
+    int queued_msgs;           // Current occupancy, only reported
+    int queued_bytes;
+};
+
+// Structure to represent a message in the MPI system; header and payload
+// share a single allocation
 struct mpi_message {
-    char *message;             // Pointer to the message data
-    ssize_t size;              // Size of the message
-    pid_t sender_pid;          // PID of the process that sent the message
     struct list_head list;     // List node for linking messages in the queue
+    ssize_t size;              // Size of the message
+    u64 stamp;                 // ktime_get_ns() when mpi_send was called
+    char message[];            // The message data
+};
+
+// Structure to represent the FIFO of messages from one sender to one receiver
+struct mpi_sender_queue {
+    pid_t sender_pid;          // PID of the process that sent the messages
+    struct list_head messages; // Messages from this sender, oldest first
+    int count;                 // Number of queued messages
+    ssize_t bytes;             // Total payload bytes of queued messages
+    struct hlist_node node;    // Node for linking queues in a sender bucket
 };
 
 // Structure to represent a process registered in the MPI system
 struct mpi_process {
-    pid_t pid;                 // PID of the registered process
-    struct list_head message_queue; // Queue of messages sent to this process
-    struct list_head list;     // List node for linking processes in the global list
+    pid_t pid;                 // PID of the registered process, or TGID if shared
+    bool shared;               // Registered with MPI_REGISTER_TGID
+    spinlock_t lock;           // Lock protecting the sender queues
+    wait_queue_head_t wait;    // Wait queue for blocking receives
+    wait_queue_head_t space_wait; // Wait queue for senders blocked on our quota
+    struct mpi_quota quota;    // Limits and occupancy of our queues, under lock
+    struct hlist_head senders[MPI_SENDER_HASH_SIZE]; // Sender queues hashed by sender PID
+    struct hlist_node node;    // Node for linking processes in a registry bucket
+};
+
+// Bucket of the process registry; the lock only serializes writers,
+// lookups walk the chain under rcu_read_lock()
+struct mpi_bucket {
+    spinlock_t lock;
+    struct hlist_head head;
+};
+
+// PID-keyed hash table of all registered MPI processes
+static struct mpi_bucket mpi_registry[MPI_HASH_SIZE];
+
+// Number of latency histogram buckets; bucket b counts latencies of
+// [2^(b-1), 2^b) microseconds, the last one everything longer
+#define MPI_LAT_BUCKETS 24
+
+// Event counters of the MPI system calls, summed up in /proc/mpi/stats and
+// /proc/mpi/latency
+struct mpi_stats {
+    u64 sends;                 // Messages queued by mpi_send
+    u64 receives;              // Messages delivered by mpi_receive
+    u64 eagain;                // Receives finding nothing, sends over quota
+    u64 wakeups;               // mpi_receive_wait sleeps ended by a message
+    u64 bytes_sent;
+    u64 bytes_received;
+    u64 send_latency[MPI_LAT_BUCKETS];  // Time spent in mpi_send
+    u64 queue_latency[MPI_LAT_BUCKETS]; // Time from mpi_send to delivery
+};
+
+// One set of counters per CPU, so the hot paths never share a cache line
+static DEFINE_PER_CPU(struct mpi_stats, mpi_stats);
+
+#define mpi_stat_add(field, n) this_cpu_add(mpi_stats.field, (n))
+#define mpi_stat_inc(field) this_cpu_inc(mpi_stats.field)
+
+// Function to get the latency histogram bucket of the time since 'start'
+static inline int mpi_lat_bucket(u64 start) {
+    u64 now = ktime_get_ns();
+
+    return min_t(int, fls64(now > start ? (now - start) / NSEC_PER_USEC : 0), MPI_LAT_BUCKETS - 1);
+}
+
+// Slab caches for registered processes and their per-sender queues
+static struct kmem_cache *mpi_process_cache;
+static struct kmem_cache *mpi_sender_queue_cache;
+// Slab cache for messages of up to MPI_SMALL_MESSAGE_SIZE bytes
+static struct kmem_cache *mpi_message_cache;
+
+// Function to show the event counters summed over all CPUs; the sums are not
+// a snapshot, the counters keep moving while they are read
+static int mpi_stats_show(struct seq_file *m, void *v) {
+    struct mpi_stats sum = { 0 };
+    struct mpi_stats *s;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        s = per_cpu_ptr(&mpi_stats, cpu);
+        sum.sends += s->sends;
+        sum.receives += s->receives;
+        sum.eagain += s->eagain;
+        sum.wakeups += s->wakeups;
+        sum.bytes_sent += s->bytes_sent;
+        sum.bytes_received += s->bytes_received;
+    }
+
+    seq_printf(m, "sends %llu\n", sum.sends);
+    seq_printf(m, "receives %llu\n", sum.receives);
+    seq_printf(m, "eagain %llu\n", sum.eagain);
+    seq_printf(m, "wakeups %llu\n", sum.wakeups);
+    seq_printf(m, "bytes_sent %llu\n", sum.bytes_sent);
+    seq_printf(m, "bytes_received %llu\n", sum.bytes_received);
+    return 0;
+}
+
+// Function to show the latency histograms summed over all CPUs
+static int mpi_latency_show(struct seq_file *m, void *v) {
+    u64 send, queue;
+    int b, cpu;
+
+    seq_printf(m, "%10s %12s %12s\n", "usecs <", "send", "queue");
+    for (b = 0; b < MPI_LAT_BUCKETS; b++) {
+        send = 0;
+        queue = 0;
+        for_each_possible_cpu(cpu) {
+            send += per_cpu_ptr(&mpi_stats, cpu)->send_latency[b];
+            queue += per_cpu_ptr(&mpi_stats, cpu)->queue_latency[b];
+        }
+        if (b < MPI_LAT_BUCKETS - 1) {
+            seq_printf(m, "%10lu %12llu %12llu\n", 1UL << b, send, queue);
+        } else {
+            seq_printf(m, "%10s %12llu %12llu\n", "inf", send, queue);
+        }
+    }
+    return 0;
+}
+
+// Function to find the registered process at position 'pos' of the
+// registry, in bucket order; caller holds rcu_read_lock()
+static struct mpi_process *mpi_registry_at(loff_t pos) {
+    struct mpi_process *proc;
+    int i;
+
+    for (i = 0; i < MPI_HASH_SIZE; i++) {
+        hlist_for_each_entry_rcu(proc, &mpi_registry[i].head, node) {
+            if (pos-- == 0) {
+                return proc;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Iterator of /proc/mpi/tasks over the registry: position 0 is the header,
+// position n the (n-1)-th registered process
+static void *mpi_tasks_start(struct seq_file *m, loff_t *pos) {
+    rcu_read_lock();
+    return *pos ? mpi_registry_at(*pos - 1) : SEQ_START_TOKEN;
+}
+
+// Function to find the first registered process in bucket i or a later one
+static struct mpi_process *mpi_registry_from(int i) {
+    struct hlist_node *first;
+
+    for (; i < MPI_HASH_SIZE; i++) {
+        first = rcu_dereference(hlist_first_rcu(&mpi_registry[i].head));
+        if (first) {
+            return hlist_entry(first, struct mpi_process, node);
+        }
+    }
+    return NULL;
+}
+
+// Continue from v rather than from the start of the registry, so that
+// listing N processes stays O(N)
+static void *mpi_tasks_next(struct seq_file *m, void *v, loff_t *pos) {
+    struct mpi_process *proc = v;
+    struct hlist_node *next;
+
+    ++*pos;
+    if (v == SEQ_START_TOKEN) {
+        return mpi_registry_from(0);
+    }
+    next = rcu_dereference(hlist_next_rcu(&proc->node));
+    if (next) {
+        return hlist_entry(next, struct mpi_process, node);
+    }
+    return mpi_registry_from(hash_32((u32)proc->pid, MPI_HASH_BITS) + 1);
+}
+
+static void mpi_tasks_stop(struct seq_file *m, void *v) {
+    rcu_read_unlock();
+}
+
+// Function to show a registered process with the occupancy and quota of its
+// queues, followed by one line per sender with queued messages
+static int mpi_tasks_show(struct seq_file *m, void *v) {
+    struct mpi_process *proc = v;
+    struct mpi_sender_queue *queue;
+    int i;
+
+    if (v == SEQ_START_TOKEN) {
+        seq_puts(m, "# task pid shared msgs bytes max_msgs max_bytes max_pair_msgs max_pair_bytes waiting\n"
+                    "#   sender pid msgs bytes\n");
+        return 0;
+    }
+
+    spin_lock(&proc->lock);
+    seq_printf(m, "task %d %d %d %d %d %d %d %d %d\n",
+               proc->pid, proc->shared, proc->quota.queued_msgs, proc->quota.queued_bytes,
+               proc->quota.max_msgs, proc->quota.max_bytes, proc->quota.max_pair_msgs,
+               proc->quota.max_pair_bytes, waitqueue_active(&proc->wait));
+    for (i = 0; i < MPI_SENDER_HASH_SIZE; i++) {
+        hlist_for_each_entry(queue, &proc->senders[i], node) {
+            seq_printf(m, "  sender %d %d %zd\n", queue->sender_pid, queue->count, queue->bytes);
+        }
+    }
+    spin_unlock(&proc->lock);
+    return 0;
+}
+
+static const struct seq_operations mpi_tasks_ops = {
+    .start = mpi_tasks_start,
+    .next  = mpi_tasks_next,
+    .stop  = mpi_tasks_stop,
+    .show  = mpi_tasks_show,
 };
 
-// Global linked list to keep track of all registered MPI processes
-LIST_HEAD(mpi_processes);
-// Spinlock to protect access to the global linked list
-DEFINE_SPINLOCK(mpi_lock);
+// Directory of the MPI entries in /proc
+static struct proc_dir_entry *mpi_proc_dir;
+
+// Initialize the process registry buckets, the MPI slab caches and /proc/mpi
+static int __init mpi_init(void) {
+    int i;
+
+    mpi_process_cache = KMEM_CACHE(mpi_process, SLAB_HWCACHE_ALIGN);
+    if (!mpi_process_cache) {
+        return -ENOMEM;
+    }
+
+    mpi_sender_queue_cache = KMEM_CACHE(mpi_sender_queue, SLAB_HWCACHE_ALIGN);
+    if (!mpi_sender_queue_cache) {
+        return -ENOMEM;
+    }
+
+    mpi_message_cache = kmem_cache_create("mpi_message",
+                                          sizeof(struct mpi_message) + MPI_SMALL_MESSAGE_SIZE,
+                                          0, SLAB_HWCACHE_ALIGN, NULL);
+    if (!mpi_message_cache) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < MPI_HASH_SIZE; i++) {
+        spin_lock_init(&mpi_registry[i].lock);
+        INIT_HLIST_HEAD(&mpi_registry[i].head);
+    }
+
+    // The statistics are optional; the system calls work without them
+    mpi_proc_dir = proc_mkdir("mpi", NULL);
+    if (mpi_proc_dir) {
+        proc_create_single("stats", 0444, mpi_proc_dir, mpi_stats_show);
+        proc_create_single("latency", 0444, mpi_proc_dir, mpi_latency_show);
+        proc_create_seq("tasks", 0444, mpi_proc_dir, &mpi_tasks_ops);
+    }
+    return 0;
+}
+subsys_initcall(mpi_init);
+
+// Allocate a message with room for 'size' bytes of inline payload
+static struct mpi_message *mpi_alloc_message(ssize_t size) {
+    if (size <= MPI_SMALL_MESSAGE_SIZE) {
+        return kmem_cache_alloc(mpi_message_cache, GFP_KERNEL);
+    }
+    return kmalloc(sizeof(struct mpi_message) + size, GFP_KERNEL);
+}
+
+// Free a message allocated by mpi_alloc_message()
+static void mpi_free_message(struct mpi_message *msg) {
+    if (msg->size <= MPI_SMALL_MESSAGE_SIZE) {
+        kmem_cache_free(mpi_message_cache, msg);
+    } else {
+        kfree(msg);
+    }
+}
 
-// Function to find an MPI process in the global list by PID
+// Return the registry bucket a PID hashes to
+static inline struct mpi_bucket *mpi_bucket_of(pid_t pid) {
+    return &mpi_registry[hash_32((u32)pid, MPI_HASH_BITS)];
+}
+
+// Function to find an MPI process in the registry by PID.
+// Registered processes are never removed, so the returned entry stays
+// valid after the RCU read-side section ends.
 static struct mpi_process *find_mpi_process(pid_t pid) {
     struct mpi_process *proc;
+    struct mpi_process *found = NULL;
 
-    // Iterate over the list to find the process with the given PID
-    list_for_each_entry(proc, &mpi_processes, list) {
+    rcu_read_lock();
+    hlist_for_each_entry_rcu(proc, &mpi_bucket_of(pid)->head, node) {
         if (proc->pid == pid) {
-            return proc;  // Return the process if found
+            found = proc;  // Remember the process if found
+            break;
         }
     }
+    rcu_read_unlock();
 
-    return NULL;  // Return NULL if the process is not found
+    return found;  // NULL if the process is not found
 }
 
-// System call to register the current process in the MPI system
-asmlinkage int mpi_register(void) {
+// Function to find the registry entry receiving messages addressed to a PID:
+// its own, or the one of its thread group if that registered with
+// MPI_REGISTER_TGID
+static struct mpi_process *find_mpi_mailbox(pid_t pid) {
+    struct mpi_process *proc = find_mpi_process(pid);
+    struct task_struct *task;
+    pid_t tgid = 0;
+
+    if (proc) {
+        return proc;
+    }
+
+    rcu_read_lock();
+    task = pid_task(find_vpid(pid), PIDTYPE_PID);
+    if (task) {
+        tgid = task->tgid;
+    }
+    rcu_read_unlock();
+
+    if (!tgid || tgid == pid) {
+        return NULL;  // Return NULL if neither the task nor its group is registered
+    }
+    proc = find_mpi_process(tgid);
+    return proc && proc->shared ? proc : NULL;
+}
+
+// Function to get the PID our messages are filed under at the receiver: the
+// TGID if our thread group registered with MPI_REGISTER_TGID
+static pid_t mpi_sender_id(void) {
+    struct mpi_process *proc = find_mpi_process(current->tgid);
+
+    return proc && proc->shared ? current->tgid : current->pid;
+}
+
+// Function to find the queue of messages from a given sender to a process;
+// caller must hold proc->lock
+static struct mpi_sender_queue *find_sender_queue(struct mpi_process *proc, pid_t sender_pid) {
+    struct mpi_sender_queue *queue;
+
+    hlist_for_each_entry(queue, &proc->senders[hash_32((u32)sender_pid, MPI_SENDER_HASH_BITS)], node) {
+        if (queue->sender_pid == sender_pid) {
+            return queue;  // Return the queue if found
+        }
+    }
+
+    return NULL;  // Return NULL if the sender has no queued messages
+}
+
+// System call to register the current process in the MPI system. With
+// MPI_REGISTER_TGID the entry is keyed by our TGID and serves every thread of
+// the group: messages sent to any of them land in one set of queues that all
+// of them receive from, and their own messages are filed under the TGID.
+asmlinkage int mpi_register_ex(int flags) {
+    bool shared = flags & MPI_REGISTER_TGID;
+    pid_t key = shared ? current->tgid : current->pid;
+    struct mpi_bucket *bucket = mpi_bucket_of(key);
     struct mpi_process *proc;
-    unsigned long flags;
+    struct mpi_process *found;
+    int i;
 
-    // Acquire the spinlock to protect access to the global list
-    spin_lock_irqsave(&mpi_lock, flags);
+    if (flags & ~MPI_REGISTER_TGID) {
+        return -EINVAL;  // Return error if a flag is unknown
+    }
 
     // Check if the process is already registered
-    if (find_mpi_process(current->pid)) {
-        spin_unlock_irqrestore(&mpi_lock, flags);
-        printk(KERN_INFO "mpi_register: Process %d is already registered\n", current->pid);
-        return 0; // Return 0 if the process is already registered
+    found = find_mpi_process(key);
+    if (found) {
+        MPI_TRACE(KERN_INFO "mpi_register: Process %d is already registered\n", key);
+        return found->shared == shared ? 0 : -EBUSY; // Return 0 unless the mode differs
     }
 
     // Allocate memory for a new mpi_process structure
-    proc = kmalloc(sizeof(*proc), GFP_KERNEL);
+    proc = kmem_cache_alloc(mpi_process_cache, GFP_KERNEL);
     if (!proc) {
-        spin_unlock_irqrestore(&mpi_lock, flags);
-        printk(KERN_ERR "mpi_register: Failed to allocate memory for process %d\n", current->pid);
+        MPI_TRACE(KERN_ERR "mpi_register: Failed to allocate memory for process %d\n", current->pid);
         return -ENOMEM;  // Return -ENOMEM if memory allocation fails
     }
 
     // Initialize the new mpi_process structure
-    proc->pid = current->pid;
-    INIT_LIST_HEAD(&proc->message_queue);
-    // Add the new process to the global list
-    list_add(&proc->list, &mpi_processes);
+    proc->pid = key;
+    proc->shared = shared;
+    spin_lock_init(&proc->lock);
+    init_waitqueue_head(&proc->wait);
+    init_waitqueue_head(&proc->space_wait);
+    memset(&proc->quota, 0, sizeof(proc->quota));
+    proc->quota.max_bytes = MPI_DEFAULT_MAX_BYTES;
+    for (i = 0; i < MPI_SENDER_HASH_SIZE; i++) {
+        INIT_HLIST_HEAD(&proc->senders[i]);
+    }
 
-    // Release the spinlock
-    spin_unlock_irqrestore(&mpi_lock, flags);
+    // Publish the new process in its bucket, unless a sibling thread
+    // registered the same TGID since the lookup above
+    spin_lock(&bucket->lock);
+    hlist_for_each_entry(found, &bucket->head, node) {
+        if (found->pid == key) {
+            break;
+        }
+    }
+    if (!found) {
+        hlist_add_head_rcu(&proc->node, &bucket->head);
+    }
+    spin_unlock(&bucket->lock);
 
-    printk(KERN_INFO "mpi_register: Process %d registered successfully\n", current->pid);
+    if (found) {
+        kmem_cache_free(mpi_process_cache, proc);
+        return found->shared == shared ? 0 : -EBUSY; // Return 0 unless the mode differs
+    }
+
+    MPI_TRACE(KERN_INFO "mpi_register: Process %d registered successfully\n", key);
     return 0;  // Return 0 on success
 }
 
+// System call to register the current process in the MPI system
+asmlinkage int mpi_register(void) {
+    return mpi_register_ex(0);
+}
+
+// Function to check whether a process has room for a 'size' bytes message
+// from a sender; caller must hold proc->lock. Returns 0 if it fits,
+// -EAGAIN if the queues are full and -EMSGSIZE if it can never fit.
+static int mpi_quota_check(struct mpi_process *proc, pid_t sender_pid, ssize_t size) {
+    struct mpi_quota *q = &proc->quota;
+    struct mpi_sender_queue *queue = find_sender_queue(proc, sender_pid);
+    int pair_msgs = queue ? queue->count : 0;
+    ssize_t pair_bytes = queue ? queue->bytes : 0;
+
+    if ((q->max_bytes && size > q->max_bytes) ||
+        (q->max_pair_bytes && size > q->max_pair_bytes)) {
+        return -EMSGSIZE;
+    }
+    if ((q->max_msgs && q->queued_msgs >= q->max_msgs) ||
+        (q->max_bytes && q->queued_bytes + size > q->max_bytes) ||
+        (q->max_pair_msgs && pair_msgs >= q->max_pair_msgs) ||
+        (q->max_pair_bytes && pair_bytes + size > q->max_pair_bytes)) {
+        return -EAGAIN;
+    }
+    return 0;
+}
+
+// Function to check whether a blocked sender should retry its send
+static bool mpi_quota_admits(struct mpi_process *proc, pid_t sender_pid, ssize_t size) {
+    bool admits;
+
+    spin_lock(&proc->lock);
+    admits = mpi_quota_check(proc, sender_pid, size) != -EAGAIN;
+    spin_unlock(&proc->lock);
+
+    return admits;
+}
+
+// Function to tell whether the current process asked its sends to block
+static bool mpi_send_blocks(void) {
+    struct mpi_process *self = find_mpi_mailbox(current->pid);
+
+    return self && (READ_ONCE(self->quota.flags) & MPI_QUOTA_BLOCK);
+}
+
 // System call to send a message to a specified process
 asmlinkage int mpi_send(pid_t pid, char *message, ssize_t message_size) {
     struct mpi_process *proc;
+    struct mpi_sender_queue *queue;
+    struct mpi_sender_queue *new_queue = NULL;
     struct mpi_message *msg;
-    unsigned long flags;
+    pid_t sender_pid = mpi_sender_id();
+    u64 start = ktime_get_ns();
+    int res;
 
     if (!message || message_size < 1) {
-        printk(KERN_ERR "mpi_send: Invalid message or size from process %d\n", current->pid);
+        MPI_TRACE(KERN_ERR "mpi_send: Invalid message or size from process %d\n", current->pid);
         return -EINVAL;  // Return error if message is invalid
     }
 
-    // Acquire the spinlock to protect access to the global list
-    spin_lock_irqsave(&mpi_lock, flags);
-
     // Find the target process by PID
-    proc = find_mpi_process(pid);
+    proc = find_mpi_mailbox(pid);
     if (!proc) {
-        spin_unlock_irqrestore(&mpi_lock, flags);
-        printk(KERN_ERR "mpi_send: Target process %d not found\n", pid);
+        MPI_TRACE(KERN_ERR "mpi_send: Target process %d not found\n", pid);
         return -ESRCH;  // Return error if the target process is not found
     }
 
-    // Allocate memory for a new mpi_message structure
-    msg = kmalloc(sizeof(*msg), GFP_KERNEL);
-    if (!msg) {
-        spin_unlock_irqrestore(&mpi_lock, flags);
-        printk(KERN_ERR "mpi_send: Failed to allocate memory for message\n");
-        return -ENOMEM;  // Return -ENOMEM if memory allocation fails
-    }
+    // Stage the message before taking any lock: allocation and the copy
+    // from user space may sleep and must not stall other senders
 
-    // Allocate memory for the message data
-    msg->message = kmalloc(message_size, GFP_KERNEL);
-    if (!msg->message) {
-        kfree(msg);
-        spin_unlock_irqrestore(&mpi_lock, flags);
-        printk(KERN_ERR "mpi_send: Failed to allocate memory for message data\n");
+    // Allocate a new mpi_message structure together with its data
+    msg = mpi_alloc_message(message_size);
+    if (!msg) {
+        MPI_TRACE(KERN_ERR "mpi_send: Failed to allocate memory for message\n");
         return -ENOMEM;  // Return -ENOMEM if memory allocation fails
     }
+    msg->size = message_size;
+    msg->stamp = start;
 
     // Copy the message data from user space to kernel space
     if (copy_from_user(msg->message, message, message_size)) {
-        kfree(msg->message);
-        kfree(msg);
-        spin_unlock_irqrestore(&mpi_lock, flags);
-        printk(KERN_ERR "mpi_send: Failed to copy message from user space for process %d\n", current->pid);
+        mpi_free_message(msg);
+        MPI_TRACE(KERN_ERR "mpi_send: Failed to copy message from user space for process %d\n", current->pid);
         return -EFAULT;  // Return error if copying fails
     }
 
-    // Initialize the new mpi_message structure
-    msg->size = message_size;
-    msg->sender_pid = current->pid;
-    // Add the message to the target process's message queue
-    list_add_tail(&msg->list, &proc->message_queue);
+    // Acquire the target's queue lock; it only covers linking the message
+    spin_lock(&proc->lock);
+
+    for (;;) {
+        // Wait for the target's quota to admit the message, or give up
+        while ((res = mpi_quota_check(proc, sender_pid, message_size)) == -EAGAIN && mpi_send_blocks()) {
+            spin_unlock(&proc->lock);
+            if (wait_event_interruptible(proc->space_wait, mpi_quota_admits(proc, sender_pid, message_size))) {
+                if (new_queue) {
+                    kmem_cache_free(mpi_sender_queue_cache, new_queue);
+                }
+                mpi_free_message(msg);
+                return -EINTR;  // Return error if interrupted by a signal
+            }
+            spin_lock(&proc->lock);
+        }
+        if (res) {
+            spin_unlock(&proc->lock);
+            if (new_queue) {
+                kmem_cache_free(mpi_sender_queue_cache, new_queue);
+            }
+            mpi_free_message(msg);
+            if (res == -EAGAIN) {
+                mpi_stat_inc(eagain);
+            }
+            MPI_TRACE(KERN_INFO "mpi_send: Process %d is over its quota\n", pid);
+            return res;  // Return -EAGAIN or -EMSGSIZE if the quota does not admit the message
+        }
+
+        // Find our queue in the target process, creating it on our first message
+        queue = find_sender_queue(proc, sender_pid);
+        if (queue || new_queue) {
+            break;
+        }
+
+        // Allocate the queue with the lock dropped, then check the quota
+        // again: it may have filled up in the meantime
+        spin_unlock(&proc->lock);
+        new_queue = kmem_cache_alloc(mpi_sender_queue_cache, GFP_KERNEL);
+        if (!new_queue) {
+            mpi_free_message(msg);
+            MPI_TRACE(KERN_ERR "mpi_send: Failed to allocate memory for sender queue\n");
+            return -ENOMEM;  // Return -ENOMEM if memory allocation fails
+        }
+        new_queue->sender_pid = sender_pid;
+        INIT_LIST_HEAD(&new_queue->messages);
+        new_queue->count = 0;
+        new_queue->bytes = 0;
+        spin_lock(&proc->lock);
+    }
+    if (!queue) {
+        queue = new_queue;
+        new_queue = NULL;
+        hlist_add_head(&queue->node, &proc->senders[hash_32((u32)sender_pid, MPI_SENDER_HASH_BITS)]);
+    }
 
-    // Release the spinlock
-    spin_unlock_irqrestore(&mpi_lock, flags);
+    // Add the message to the tail of our FIFO in the target process
+    list_add_tail(&msg->list, &queue->messages);
+    queue->count++;
+    queue->bytes += message_size;
+    proc->quota.queued_msgs++;
+    proc->quota.queued_bytes += message_size;
 
-    printk(KERN_INFO "mpi_send: Process %d sent a message to process %d\n", current->pid, pid);
+    // Release the queue lock
+    spin_unlock(&proc->lock);
+
+    // Free the spare queue if another path created ours in the meantime
+    if (new_queue) {
+        kmem_cache_free(mpi_sender_queue_cache, new_queue);
+    }
+
+    // Wake the target if it is blocked in mpi_receive_wait
+    wake_up_interruptible(&proc->wait);
+
+    mpi_stat_inc(sends);
+    mpi_stat_add(bytes_sent, message_size);
+    mpi_stat_inc(send_latency[mpi_lat_bucket(start)]);
+
+    MPI_TRACE(KERN_INFO "mpi_send: Process %d sent a message to process %d\n", current->pid, pid);
     return 0;  // Return 0 on success
 }
 
+// Function to check whether a process has a queued message from a given sender
+static bool mpi_message_pending(struct mpi_process *proc, pid_t sender_pid) {
+    bool pending;
+
+    spin_lock(&proc->lock);
+    pending = find_sender_queue(proc, sender_pid) != NULL;
+    spin_unlock(&proc->lock);
+
+    return pending;
+}
+
 // System call to receive a message from a specified process
 asmlinkage int mpi_receive(pid_t pid, char *message, ssize_t message_size) {
     struct mpi_process *proc;
-    struct mpi_message *msg, *tmp;
+    struct mpi_sender_queue *queue;
+    struct mpi_message *msg;
     ssize_t copied_size = 0;
-    unsigned long flags;
+    int bucket;
 
     if (!message || message_size < 1) {
-        printk(KERN_ERR "mpi_receive: Invalid message buffer or size for process %d\n", current->pid);
+        MPI_TRACE(KERN_ERR "mpi_receive: Invalid message buffer or size for process %d\n", current->pid);
         return -EINVAL;  // Return error if message buffer is invalid
     }
 
-    // Acquire the spinlock to protect access to the global list
-    spin_lock_irqsave(&mpi_lock, flags);
+    // Find the current process in the registry
+    proc = find_mpi_mailbox(current->pid);
+    if (!proc) {
+        MPI_TRACE(KERN_ERR "mpi_receive: Process %d is not registered\n", current->pid);
+        return -EPERM;  // Return error if the current process is not registered
+    }
+
+    // Acquire our own queue lock
+    spin_lock(&proc->lock);
+
+    // Look up the FIFO of the specified sender
+    queue = find_sender_queue(proc, pid);
+    if (!queue) {
+        spin_unlock(&proc->lock);
+        mpi_stat_inc(eagain);
+        MPI_TRACE(KERN_INFO "mpi_receive: No message from process %d found for process %d\n", pid, current->pid);
+        return -EAGAIN;  // Return error if no message from the specified sender is found
+    }
+
+    // Remove the oldest message from the sender's FIFO
+    msg = list_first_entry(&queue->messages, struct mpi_message, list);
+    list_del(&msg->list);
+    queue->count--;
+    queue->bytes -= msg->size;
+    proc->quota.queued_msgs--;
+    proc->quota.queued_bytes -= msg->size;
+    // Drop the sender's queue once it is drained
+    if (list_empty(&queue->messages)) {
+        hlist_del(&queue->node);
+        kmem_cache_free(mpi_sender_queue_cache, queue);
+    }
+
+    // Release the queue lock before touching user memory
+    spin_unlock(&proc->lock);
 
-    // Find the current process in the global list
-    proc = find_mpi_process(current->pid);
+    // Let senders blocked on our quota retry
+    wake_up_interruptible(&proc->space_wait);
+
+    bucket = mpi_lat_bucket(msg->stamp);
+    copied_size = min(msg->size, message_size);
+    // Copy the message data from kernel space to user space
+    if (copy_to_user(message, msg->message, copied_size)) {
+        mpi_free_message(msg);
+        MPI_TRACE(KERN_ERR "mpi_receive: Failed to copy message to user space for process %d\n", current->pid);
+        return -EFAULT;  // Return error if copying fails
+    }
+
+    // Free the allocated memory for the message
+    mpi_free_message(msg);
+    mpi_stat_inc(receives);
+    mpi_stat_add(bytes_received, copied_size);
+    mpi_stat_inc(queue_latency[bucket]);
+    MPI_TRACE(KERN_INFO "mpi_receive: Process %d received a message from process %d\n", current->pid, pid);
+    return copied_size;  // Return the size of the copied message
+}
+
+// System call to get the size of the oldest message from a specified process
+// without dequeuing it, so the caller can size its buffer for mpi_receive
+asmlinkage int mpi_probe(pid_t pid) {
+    struct mpi_process *proc;
+    struct mpi_sender_queue *queue;
+    int size;
+
+    // Find the current process in the registry
+    proc = find_mpi_mailbox(current->pid);
     if (!proc) {
-        spin_unlock_irqrestore(&mpi_lock, flags);
-        printk(KERN_ERR "mpi_receive: Process %d is not registered\n", current->pid);
+        MPI_TRACE(KERN_ERR "mpi_probe: Process %d is not registered\n", current->pid);
         return -EPERM;  // Return error if the current process is not registered
     }
 
-    // Iterate over the message queue to find a message from the specified sender
-    list_for_each_entry_safe(msg, tmp, &proc->message_queue, list) {
-        if (msg->sender_pid == pid) {
-            // Remove the message from the queue
-            list_del(&msg->list);
-            copied_size = min(msg->size, message_size);
-            // Copy the message data from kernel space to user space
-            if (copy_to_user(message, msg->message, copied_size)) {
-                spin_unlock_irqrestore(&mpi_lock, flags);
-                kfree(msg->message);
-                kfree(msg);
-                printk(KERN_ERR "mpi_receive: Failed to copy message to user space for process %d\n", current->pid);
-                return -EFAULT;  // Return error if copying fails
-            }
-            // Free the allocated memory for the message
-            kfree(msg->message);
-            kfree(msg);
-            spin_unlock_irqrestore(&mpi_lock, flags);
-            printk(KERN_INFO "mpi_receive: Process %d received a message from process %d\n", current->pid, pid);
-            return copied_size;  // Return the size of the copied message
+    spin_lock(&proc->lock);
+    queue = find_sender_queue(proc, pid);
+    size = queue ? list_first_entry(&queue->messages, struct mpi_message, list)->size : -EAGAIN;
+    spin_unlock(&proc->lock);
+
+    return size;  // Return the size of the head message, or -EAGAIN if there is none
+}
+
+// System call to receive a message from a specified process, sleeping until
+// one arrives. The timeout is in milliseconds: 0 does not block and a
+// negative value waits forever.
+asmlinkage int mpi_receive_wait(pid_t pid, char *message, ssize_t message_size, long timeout_ms) {
+    struct mpi_process *proc;
+    long timeout, remaining;
+    int res;
+
+    // Try to receive without sleeping first
+    res = mpi_receive(pid, message, message_size);
+    if (res != -EAGAIN || timeout_ms == 0) {
+        return res;
+    }
+
+    proc = find_mpi_mailbox(current->pid);
+    timeout = timeout_ms < 0 ? MAX_SCHEDULE_TIMEOUT : msecs_to_jiffies(timeout_ms);
+
+    for (;;) {
+        // Sleep until the sender queues a message, the timeout expires or a signal arrives
+        remaining = wait_event_interruptible_timeout(proc->wait, mpi_message_pending(proc, pid), timeout);
+        if (remaining < 0) {
+            return -EINTR;  // Return error if interrupted by a signal
+        }
+        if (remaining == 0) {
+            return -ETIMEDOUT;  // Return error if no message arrived in time
+        }
+        mpi_stat_inc(wakeups);
+
+        res = mpi_receive(pid, message, message_size);
+        if (res != -EAGAIN) {
+            return res;
+        }
+        if (timeout != MAX_SCHEDULE_TIMEOUT) {
+            timeout = remaining;
         }
     }
+}
+
+// System call to get and/or set the limits on messages queued for the current
+// process. The current settings and occupancy are stored in 'oquota' if it is
+// not NULL, then the limits and flags of 'quota' are applied if it is not NULL.
+asmlinkage int mpi_quota(const struct mpi_quota *quota, struct mpi_quota *oquota) {
+    struct mpi_process *proc;
+    struct mpi_quota q;
 
-    // Release the spinlock
-    spin_unlock_irqrestore(&mpi_lock, flags);
-    printk(KERN_INFO "mpi_receive: No message from process %d found for process %d\n", pid, current->pid);
-    return -EAGAIN;  // Return error if no message from the specified sender is found
+    // Find the current process in the registry
+    proc = find_mpi_mailbox(current->pid);
+    if (!proc) {
+        MPI_TRACE(KERN_ERR "mpi_quota: Process %d is not registered\n", current->pid);
+        return -EPERM;  // Return error if the current process is not registered
+    }
+
+    if (oquota) {
+        spin_lock(&proc->lock);
+        q = proc->quota;
+        spin_unlock(&proc->lock);
+        if (copy_to_user(oquota, &q, sizeof(q))) {
+            return -EFAULT;  // Return error if copying fails
+        }
+    }
+
+    if (quota) {
+        if (copy_from_user(&q, quota, sizeof(q))) {
+            return -EFAULT;  // Return error if copying fails
+        }
+        if (q.max_msgs < 0 || q.max_bytes < 0 || q.max_pair_msgs < 0 ||
+            q.max_pair_bytes < 0 || (q.flags & ~MPI_QUOTA_BLOCK)) {
+            return -EINVAL;  // Return error if a limit or flag is invalid
+        }
+
+        spin_lock(&proc->lock);
+        proc->quota.max_msgs = q.max_msgs;
+        proc->quota.max_bytes = q.max_bytes;
+        proc->quota.max_pair_msgs = q.max_pair_msgs;
+        proc->quota.max_pair_bytes = q.max_pair_bytes;
+        proc->quota.flags = q.flags;
+        spin_unlock(&proc->lock);
+
+        // The limits may have grown; let blocked senders recheck
+        wake_up_interruptible(&proc->space_wait);
+    }
+
+    MPI_TRACE(KERN_INFO "mpi_quota: Process %d updated its quota\n", current->pid);
+    return 0;  // Return 0 on success
 }
@@ -5,6 +5,33 @@
 #include <sys/types.h>
 #include <errno.h>
 
+// System call numbers of the MPI calls, for callers that go through syscall()
+#define SYS_mpi_register 243
+#define SYS_mpi_send 244
+#define SYS_mpi_receive 245
+#define SYS_mpi_receive_wait 246
+#define SYS_mpi_quota 247
+#define SYS_mpi_probe 248
+#define SYS_mpi_register_ex 249
+
+// Limits on the messages queued for a process, see mpi_quota. A limit of 0
+// means unlimited; with MPI_QUOTA_BLOCK set our sends to a full receiver
+// sleep instead of failing with EAGAIN.
+struct mpi_quota {
+    int max_msgs;
+    int max_bytes;
+    int max_pair_msgs;
+    int max_pair_bytes;
+    int flags;
+    int queued_msgs;
+    int queued_bytes;
+};
+
+#define MPI_QUOTA_BLOCK 1
+
+// Register every thread of the process under its TGID, see mpi_register_ex
+#define MPI_REGISTER_TGID 1
+
 static inline int mpi_register(void) {
     int res;
     __asm__ (
@@ -24,6 +51,30 @@ static inline int mpi_register(void) {
     return 0;
 }
 
+// Register with flags; MPI_REGISTER_TGID makes all our threads share one set
+// of queues, and our messages are filed under our TGID
+static inline int mpi_register_ex(int flags) {
+    int res;
+    __asm__ (
+        "pushl %%eax;\n"
+        "pushl %%ebx;\n"
+        "movl $249, %%eax;\n"  // System call number for mpi_register_ex
+        "movl %1, %%ebx;\n"
+        "int $0x80;\n"
+        "movl %%eax, %0;\n"
+        "popl %%ebx;\n"
+        "popl %%eax;"
+        : "=r" (res)
+        : "r" (flags)
+        : "eax", "ebx"
+    );
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return 0;
+}
+
 static inline int mpi_send(pid_t pid, char *message, ssize_t message_size) {
     int res;
     __asm__ (
@@ -80,4 +131,86 @@ static inline int mpi_receive(pid_t pid, char *message, ssize_t message_size) {
     return res;
 }
 
+// Size of the oldest message from pid, without dequeuing it
+static inline int mpi_probe(pid_t pid) {
+    int res;
+    __asm__ (
+        "pushl %%eax;\n"
+        "pushl %%ebx;\n"
+        "movl $248, %%eax;\n"  // System call number for mpi_probe
+        "movl %1, %%ebx;\n"
+        "int $0x80;\n"
+        "movl %%eax, %0;\n"
+        "popl %%ebx;\n"
+        "popl %%eax;"
+        : "=r" (res)
+        : "r" (pid)
+        : "eax", "ebx"
+    );
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
+
+// Blocking receive; timeout is in milliseconds, 0 does not block and a
+// negative value waits forever
+static inline int mpi_receive_wait(pid_t pid, char *message, ssize_t message_size, long timeout) {
+    int res;
+    __asm__ (
+        "pushl %%eax;\n"
+        "pushl %%ebx;\n"
+        "pushl %%ecx;\n"
+        "pushl %%edx;\n"
+        "pushl %%esi;\n"
+        "movl $246, %%eax;\n"  // System call number for mpi_receive_wait
+        "movl %1, %%ebx;\n"
+        "movl %2, %%ecx;\n"
+        "movl %3, %%edx;\n"
+        "movl %4, %%esi;\n"
+        "int $0x80;\n"
+        "movl %%eax, %0;\n"
+        "popl %%esi;\n"
+        "popl %%edx;\n"
+        "popl %%ecx;\n"
+        "popl %%ebx;\n"
+        "popl %%eax;"
+        : "=r" (res)
+        : "r" (pid), "r" (message), "r" (message_size), "r" (timeout)
+        : "eax", "ebx", "ecx", "edx", "esi"
+    );
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
+
+// Get and/or set our quota; either argument may be NULL
+static inline int mpi_quota(const struct mpi_quota *quota, struct mpi_quota *oquota) {
+    int res;
+    __asm__ (
+        "pushl %%eax;\n"
+        "pushl %%ebx;\n"
+        "pushl %%ecx;\n"
+        "movl $247, %%eax;\n"  // System call number for mpi_quota
+        "movl %1, %%ebx;\n"
+        "movl %2, %%ecx;\n"
+        "int $0x80;\n"
+        "movl %%eax, %0;\n"
+        "popl %%ecx;\n"
+        "popl %%ebx;\n"
+        "popl %%eax;"
+        : "=r" (res)
+        : "r" (quota), "r" (oquota)
+        : "eax", "ebx", "ecx"
+    );
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return 0;
+}
+
 #endif // MPI_API_H
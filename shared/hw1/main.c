@@ -1,23 +1,164 @@
+#define _POSIX_C_SOURCE 199309L
+
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "linux/mpi_api.h"
+
+// Explicitly declare the syscall function prototype
+long syscall(long number, ...);
+
+static int failures = 0;
 
-// Define the syscall numbers if not defined
-#ifndef SYS_mpi_register
-#define SYS_mpi_register 243
-#endif
+// Report one check and count it if it failed
+static void check(const char *what, int ok) {
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    if (!ok) {
+        failures++;
+    }
+}
 
-#ifndef SYS_mpi_send
-#define SYS_mpi_send 244
-#endif
+// Whether a syscall failed with the expected errno
+static int failed_with(long res, int err) {
+    return res == -1 && errno == err;
+}
 
-#ifndef SYS_mpi_receive
-#define SYS_mpi_receive 245
-#endif
+static void sleep_ms(long ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
 
-// Explicitly declare the syscall function prototype
-long syscall(long number, ...);
+    nanosleep(&ts, NULL);
+}
+
+// Set our quota to the given limits and flags
+static long set_quota(int max_msgs, int max_bytes, int flags) {
+    struct mpi_quota quota = { 0 };
+
+    quota.max_msgs = max_msgs;
+    quota.max_bytes = max_bytes;
+    quota.flags = flags;
+    return syscall(SYS_mpi_quota, &quota, NULL);
+}
+
+// mpi_receive_wait: timeouts, and a message that arrives while we sleep
+static void test_receive_wait(void) {
+    pid_t self = getpid();
+    char buffer[100];
+    int status;
+    pid_t child;
+
+    check("mpi_receive_wait with timeout 0 fails with EAGAIN",
+          failed_with(syscall(SYS_mpi_receive_wait, self, buffer, sizeof(buffer), 0L), EAGAIN));
+    check("mpi_receive_wait times out with ETIMEDOUT",
+          failed_with(syscall(SYS_mpi_receive_wait, self, buffer, sizeof(buffer), 20L), ETIMEDOUT));
+    syscall(SYS_mpi_send, self, "hello", 6);
+    check("mpi_receive_wait returns a queued message at once",
+          syscall(SYS_mpi_receive_wait, self, buffer, sizeof(buffer), -1L) == 6);
+
+    child = fork();
+    if (child == 0) {
+        sleep_ms(50);
+        _exit(syscall(SYS_mpi_send, getppid(), "late", 5) == -1);
+    }
+    check("mpi_receive_wait wakes up for a message sent while it sleeps",
+          syscall(SYS_mpi_receive_wait, child, buffer, sizeof(buffer), 1000L) == 5);
+    waitpid(child, &status, 0);
+}
+
+// Quota limits on messages we send ourselves
+static void test_quota(void) {
+    pid_t self = getpid();
+    struct mpi_quota quota;
+    char buffer[100];
+
+    check("mpi_quota rejects a negative limit", failed_with(set_quota(-1, 0, 0), EINVAL));
+    check("mpi_quota rejects an unknown flag", failed_with(set_quota(0, 0, 2), EINVAL));
+    check("mpi_quota sets a message limit", set_quota(1, 0, 0) == 0);
+    check("a send within the message limit succeeds", syscall(SYS_mpi_send, self, "a", 2) == 0);
+    check("a send over the message limit fails with EAGAIN", failed_with(syscall(SYS_mpi_send, self, "b", 2), EAGAIN));
+    check("mpi_quota reports the occupancy",
+          syscall(SYS_mpi_quota, NULL, &quota) == 0 && quota.queued_msgs == 1 && quota.queued_bytes == 2);
+    syscall(SYS_mpi_receive, self, buffer, sizeof(buffer));
+    check("mpi_quota sets a byte limit", set_quota(0, 4, 0) == 0);
+    check("a message over the byte limit fails with EMSGSIZE",
+          failed_with(syscall(SYS_mpi_send, self, "hello", 6), EMSGSIZE));
+    set_quota(0, 0, 0);
+}
+
+// A sender with MPI_QUOTA_BLOCK sleeps on a full receiver until it drains
+static void test_blocking_send(void) {
+    pid_t parent = getpid();
+    char buffer[100];
+    int status;
+    pid_t child;
+
+    set_quota(1, 0, 0);
+    child = fork();
+    if (child == 0) {
+        // Both sends must succeed; the second one only once the parent receives
+        if (syscall(SYS_mpi_register) == -1 || set_quota(0, 0, MPI_QUOTA_BLOCK) == -1 ||
+            syscall(SYS_mpi_send, parent, "a", 2) == -1 || syscall(SYS_mpi_send, parent, "b", 2) == -1) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+
+    check("the first message from a blocking sender arrives",
+          syscall(SYS_mpi_receive_wait, child, buffer, sizeof(buffer), 1000L) == 2 && buffer[0] == 'a');
+    check("the blocked sender is let through after a receive",
+          syscall(SYS_mpi_receive_wait, child, buffer, sizeof(buffer), 1000L) == 2 && buffer[0] == 'b');
+    waitpid(child, &status, 0);
+    check("no send of a blocking sender failed", WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    set_quota(0, 0, 0);
+}
+
+// mpi_probe: the size of the oldest message, which stays queued
+static void test_probe(void) {
+    pid_t self = getpid();
+    char buffer[100];
+
+    check("mpi_probe of an empty queue fails with EAGAIN", failed_with(syscall(SYS_mpi_probe, self), EAGAIN));
+    syscall(SYS_mpi_send, self, "hello", 6);
+    syscall(SYS_mpi_send, self, "hi", 3);
+    check("mpi_probe returns the size of the oldest message", syscall(SYS_mpi_probe, self) == 6);
+    check("mpi_probe does not dequeue", syscall(SYS_mpi_probe, self) == 6);
+    check("mpi_receive returns the oldest message",
+          syscall(SYS_mpi_receive, self, buffer, sizeof(buffer)) == 6 && strcmp(buffer, "hello") == 0);
+    check("mpi_probe moves on to the next message", syscall(SYS_mpi_probe, self) == 3);
+    syscall(SYS_mpi_receive, self, buffer, sizeof(buffer));
+}
+
+// mpi_register_ex: unknown flags, mode changes and messages filed under the TGID
+static void test_register_ex(void) {
+    pid_t parent = getpid();
+    char buffer[100];
+    int status;
+    pid_t child;
+
+    check("mpi_register_ex rejects an unknown flag", failed_with(syscall(SYS_mpi_register_ex, 4), EINVAL));
+    check("registering again in the same mode is a no-op", syscall(SYS_mpi_register_ex, 0) == 0);
+    check("registering again under the TGID fails with EBUSY",
+          failed_with(syscall(SYS_mpi_register_ex, MPI_REGISTER_TGID), EBUSY));
+
+    child = fork();
+    if (child == 0) {
+        if (syscall(SYS_mpi_register_ex, MPI_REGISTER_TGID) == -1 ||
+            syscall(SYS_mpi_register_ex, MPI_REGISTER_TGID) == -1 ||
+            !failed_with(syscall(SYS_mpi_register_ex, 0), EBUSY) ||
+            syscall(SYS_mpi_send, parent, "tgid", 5) == -1) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    waitpid(child, &status, 0);
+    check("a TGID registration can be repeated but not changed", WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    check("messages of a TGID registration are filed under the TGID",
+          syscall(SYS_mpi_receive, child, buffer, sizeof(buffer)) == 5);
+}
 
 int main() {
     int res;
@@ -43,7 +184,12 @@ int main() {
         perror("mpi_receive failed with no messages");
     }
 
-    // Further tests for successful sending and receiving messages can be added here
+    test_receive_wait();
+    test_quota();
+    test_blocking_send();
+    test_probe();
+    test_register_ex();
 
-    return 0;
+    printf("%d checks failed\n", failures);
+    return failures != 0;
 }
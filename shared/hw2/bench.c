@@ -0,0 +1,139 @@
+// Benchmark of mpi_reduce against gathering the vectors in user space.
+// Build with: gcc -O2 -o bench bench.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "mpi_api.h"
+
+// Number of timed reductions per rank count
+#define BENCH_ROUNDS 1000
+// Elements of every reduced vector
+#define BENCH_COUNT 4096
+// Largest number of ranks, root included
+#define BENCH_MAX_RANKS 16
+
+// Rank counts to measure at
+static const int rank_counts[] = { 2, 4, 8, 16 };
+
+static pid_t children[BENCH_MAX_RANKS];
+
+static double elapsed_us(struct timeval *start, struct timeval *end) {
+    return (end->tv_sec - start->tv_sec) * 1e6 + (end->tv_usec - start->tv_usec);
+}
+
+// Body of a non-root rank: for every go token from the root, contribute a
+// vector of ones, by mpi_send for 'g' and by mpi_reduce for 'r'
+static void run_rank(pid_t root) {
+    static int vec[BENCH_COUNT];
+    char token;
+    int i;
+
+    for (i = 0; i < BENCH_COUNT; i++)
+        vec[i] = 1;
+    for (i = 0; i < 2 * BENCH_ROUNDS; i++) {
+        if (mpi_receive_wait(root, &token, 1, -1) != 1)
+            _exit(1);
+        if (token == 'g')
+            mpi_send(root, (char *)vec, sizeof(vec));
+        else
+            mpi_reduce(root, MPI_SUM | MPI_INT32, vec, BENCH_COUNT, 0);
+    }
+    _exit(0);
+}
+
+// Sum the ranks' vectors at the root: one receive and one copy per rank
+static int gather_round(int nranks, int *acc) {
+    static int vec[BENCH_COUNT];
+    int i, j;
+
+    for (j = 0; j < BENCH_COUNT; j++)
+        acc[j] = 1;
+    mpi_bcast(children, nranks - 1, "g", 1);
+    for (i = 0; i < nranks - 1; i++) {
+        if (mpi_receive_wait(children[i], (char *)vec, sizeof(vec), -1) != sizeof(vec)) {
+            perror("mpi_receive_wait failed");
+            return -1;
+        }
+        for (j = 0; j < BENCH_COUNT; j++)
+            acc[j] += vec[j];
+    }
+    return 0;
+}
+
+// Sum the ranks' vectors in the kernel as they arrive
+static int reduce_round(int nranks, int *acc) {
+    int j;
+
+    for (j = 0; j < BENCH_COUNT; j++)
+        acc[j] = 1;
+    mpi_bcast(children, nranks - 1, "r", 1);
+    if (mpi_reduce(getpid(), MPI_SUM | MPI_INT32, acc, BENCH_COUNT, nranks)) {
+        perror("mpi_reduce failed");
+        return -1;
+    }
+    return 0;
+}
+
+// Time BENCH_ROUNDS rounds of one method and check the last result
+static int bench_method(int (*round)(int, int *), int nranks, double *us) {
+    static int acc[BENCH_COUNT];
+    struct timeval start, end;
+    int r;
+
+    gettimeofday(&start, NULL);
+    for (r = 0; r < BENCH_ROUNDS; r++) {
+        if (round(nranks, acc))
+            return -1;
+    }
+    gettimeofday(&end, NULL);
+
+    if (acc[0] != nranks || acc[BENCH_COUNT - 1] != nranks) {
+        fprintf(stderr, "wrong result %d for %d ranks\n", acc[0], nranks);
+        return -1;
+    }
+    *us = elapsed_us(&start, &end) / BENCH_ROUNDS;
+    return 0;
+}
+
+int main() {
+    double gather_us, reduce_us;
+    pid_t root = getpid();
+    unsigned int i;
+    int nranks, j;
+
+    // Children of a registered process start registered
+    if (mpi_register() == -1) {
+        perror("mpi_register failed");
+        return 1;
+    }
+
+    printf("%d int32 elements per vector\n", BENCH_COUNT);
+    printf("%6s %16s %16s\n", "ranks", "gather us", "mpi_reduce us");
+    for (i = 0; i < sizeof(rank_counts) / sizeof(rank_counts[0]); i++) {
+        nranks = rank_counts[i];
+        for (j = 0; j < nranks - 1; j++) {
+            children[j] = fork();
+            if (children[j] < 0) {
+                perror("fork failed");
+                return 1;
+            }
+            if (children[j] == 0)
+                run_rank(root);
+        }
+
+        if (bench_method(gather_round, nranks, &gather_us) ||
+            bench_method(reduce_round, nranks, &reduce_us))
+            return 1;
+        printf("%6d %16.1f %16.1f\n", nranks, gather_us, reduce_us);
+
+        for (j = 0; j < nranks - 1; j++)
+            waitpid(children[j], NULL, 0);
+    }
+
+    return 0;
+}
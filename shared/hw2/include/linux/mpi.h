@@ -1,26 +1,302 @@
 #ifndef _MPI_H
 #define _MPI_H  
 
+#include <linux/config.h>
 #include <linux/slab.h>
 #include <linux/list.h>
+#include <linux/sched.h>
+#include <linux/ioctl.h>
+#include <linux/cache.h>
+#include <linux/smp.h>
+#include <linux/time.h>
 
+/*
+ * Narration of the MPI syscalls. Printing takes logbuf_lock and may drive
+ * the console, so it is compiled in only with CONFIG_MPI_TRACE.
+ */
+#ifdef CONFIG_MPI_TRACE
+#define MPI_TRACE(fmt, args...) printk(fmt, ## args)
+#else
+#define MPI_TRACE(fmt, args...) do { } while (0)
+#endif
+
+/* Latency histogram buckets: bucket b counts [2^(b-1), 2^b) microseconds */
+#define MPI_LAT_BUCKETS 24
+
+/*
+ * Event counters, one set per CPU so the hot paths never share a cache
+ * line; summed up in /proc/mpi/stats and /proc/mpi/latency. The kernel is
+ * not preemptible, so a plain increment of our own CPU's set is safe.
+ */
+struct mpi_stats {
+    unsigned long sends;
+    unsigned long receives;
+    unsigned long eagain;           /* receives finding nothing, sends over quota */
+    unsigned long wakeups;          /* receivers woken by a message */
+    unsigned long bytes_sent;
+    unsigned long bytes_received;
+    unsigned long send_latency[MPI_LAT_BUCKETS];    /* time in sys_mpi_send */
+    unsigned long queue_latency[MPI_LAT_BUCKETS];   /* send to delivery */
+} ____cacheline_aligned;
+
+extern struct mpi_stats mpi_stats[NR_CPUS];
+
+#define MPI_STAT_ADD(field, n) (mpi_stats[smp_processor_id()].field += (n))
+#define MPI_STAT_INC(field) MPI_STAT_ADD(field, 1)
+
+/* Microseconds elapsed since start, 0 if the clock was set back */
+static inline unsigned long mpi_usecs_since(struct timeval *start)
+{
+    struct timeval now;
+    long usecs;
+
+    do_gettimeofday(&now);
+    usecs = (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_usec - start->tv_usec);
+    return usecs > 0 ? usecs : 0;
+}
 
+/* Latency histogram bucket of usecs microseconds */
+static inline int mpi_lat_bucket(unsigned long usecs)
+{
+    int b = 0;
+
+    while (usecs && b < MPI_LAT_BUCKETS - 1) {
+        usecs >>= 1;
+        b++;
+    }
+    return b;
+}
+
+
+
+/* Buckets of a sender queue's hash of tag queues */
+#define MPI_TAG_HASH_SIZE 8
 
 struct pid_queue{
     list_t messages;
     pid_t sender_pid;
+    int count;              /* number of queued messages */
+    ssize_t bytes;          /* total payload of the queued messages */
     list_t l_idx;
+    list_t l_hash;          /* chain in mpi_mailbox.queue_hash */
+    list_t tag_hash[MPI_TAG_HASH_SIZE];     /* the tag queues, by tag */
+};
+
+/*
+ * The messages of one sender with one tag, oldest first. Created with the
+ * first such message and freed once drained, like the pid_queue itself.
+ */
+struct mpi_tag_queue {
+    int tag;
+    list_t messages;        /* message_node.l_tag */
+    list_t l_hash;          /* chain in pid_queue.tag_hash */
 };
 
+/* Wildcards of sys_mpi_receive_tag; tags are never negative */
+#define MPI_ANY_SOURCE (-1)
+#define MPI_ANY_TAG (-1)
+
+/* Largest payload served from the mpi_message slab cache */
+#define MPI_SMALL_MESSAGE_SIZE 256
+
+/* Payload shared by the messages of one sys_mpi_bcast or sys_mpi_scatter */
+struct mpi_buffer {
+    atomic_t count;         /* messages referring to it, plus the sender's */
+    char data[0];
+};
+
+/*
+ * Header and payload share one allocation, see mpi_alloc_message(), unless
+ * the payload is part of a shared buffer, see mpi_alloc_shared_message()
+ */
 struct message_node{
-    char *message;
     ssize_t message_size;
     list_t l_idx;
+    int tag;                /* 0 unless sent by sys_mpi_send_tag */
+    list_t l_tag;           /* chain in tag_queue */
+    struct mpi_tag_queue *tag_queue;
+    struct timeval stamp;   /* when sys_mpi_send was called */
+    char *data;             /* the payload, in message or in buffer */
+    struct mpi_buffer *buffer;
+    char message[0];
+};
+
+/* Buckets of a mailbox's sender hash: initial (inline) and largest size */
+#define MPI_QUEUE_HASH_MIN 8
+#define MPI_QUEUE_HASH_MAX 4096
+
+/* Backlog a dying mailbox frees in the exit path; bigger ones go to keventd */
+#define MPI_REAP_INLINE_MSGS 64
+
+/* Flags for sys_mpi_register_ex */
+#define MPI_REGISTER_TGID 1     /* share one mailbox with the thread group */
+#define MPI_REGISTER_NOINHERIT 2 /* forked children start unregistered */
+
+/*
+ * Messages queued for the registered tasks using the mailbox: one task, or
+ * every thread of a group registered with MPI_REGISTER_TGID. Blocked
+ * receivers and poll sets stay per task.
+ *
+ * lock covers everything below it, the watch sets and poll sets of the
+ * attached tasks, and is never held across a user copy or an allocation.
+ */
+struct mpi_mailbox {
+    atomic_t count;         /* references: users plus senders in flight */
+    spinlock_t lock;
+    int users;              /* tasks attached, see mpi_attach_mailbox() */
+    int shared;             /* registered with MPI_REGISTER_TGID */
+    int inherit;            /* not MPI_REGISTER_NOINHERIT, see mpi_fork() */
+    list_t tasks;           /* attached tasks, by task_t.l_mpi_mailbox */
+    list_t l_queue_by_pid;  /* non-empty pid_queues, see sys_mpi_receive_any */
+    list_t *queue_hash;     /* the same pid_queues hashed by sender pid */
+    int queue_hash_size;    /* power of two, grows with nr_queues */
+    int nr_queues;
+    list_t queue_hash_inline[MPI_QUEUE_HASH_MIN];
+    int max_msgs;           /* quota, see sys_mpi_quota() */
+    long max_bytes;
+    int max_pair_msgs;
+    long max_pair_bytes;
+    int queued_msgs;
+    long queued_bytes;
+    wait_queue_head_t space_wait;   /* senders blocked on the quota */
+    struct mpi_reduce *reduce;      /* reduction in progress, see sys_mpi_reduce() */
+    wait_queue_head_t reduce_wait;  /* its root waiting for contributions */
+};
+
+/* sys_mpi_reduce op: one operation or'ed with one element type */
+#define MPI_SUM 1
+#define MPI_MIN 2
+#define MPI_MAX 3
+#define MPI_OP_MASK 0x0f
+#define MPI_INT32 0x10
+#define MPI_INT64 0x20
+#define MPI_FLOAT 0x30
+#define MPI_TYPE_MASK 0xf0
+
+/* Largest vector a reduction accumulates */
+#define MPI_REDUCE_MAX_BYTES 65536
+
+/* Contributions folded so far into a reduction towards a mailbox */
+struct mpi_reduce {
+    int op;
+    int count;              /* elements */
+    int contributions;
+    char acc[0];
 };
 
+/* The pid our messages are filed under at the receiver */
+static inline pid_t mpi_sender_id(task_t *p)
+{
+    return p->mpi_mailbox && p->mpi_mailbox->shared ? p->tgid : p->pid;
+}
+
 struct mpi_poll_entry {
     pid_t pid;
     char incoming;
+    int count;              /* messages queued from pid */
+    ssize_t bytes;          /* payload bytes queued from pid */
+};
+
+/* One entry of sys_mpi_sendv / sys_mpi_recvv */
+struct mpi_iovec {
+    pid_t pid;              /* receiver (sendv) or sender (recvv) */
+    char *buf;
+    ssize_t len;
+    int status;             /* out: 0 or bytes received, or a negative error */
+};
+
+/* Largest number of entries accepted by one sendv / recvv call */
+#define MPI_IOV_MAX 1024
+
+/* Largest watch set of one sys_mpi_poll call; 128 KB of pids */
+#define MPI_POLL_MAX 32768
+
+/* Operations for sys_mpi_pollset_ctl */
+#define MPI_POLLSET_ADD 1
+#define MPI_POLLSET_DEL 2
+
+#define MPI_POLLSET_HASH_SIZE 64
+
+/* A pid watched by a task's persistent poll set */
+struct mpi_pollset_entry {
+    pid_t pid;
+    int ready;              /* linked on the ready list */
+    list_t l_hash;          /* chain in mpi_pollset.hash */
+    list_t l_ready;         /* link in mpi_pollset.ready */
+};
+
+/* Persistent, edge-triggered poll set, see sys_mpi_pollset_ctl() */
+struct mpi_pollset {
+    list_t hash[MPI_POLLSET_HASH_SIZE];
+    list_t ready;           /* entries that received a message since last reported */
 };
 
+/* Argument of the MPI_RING_CREATE ioctl on /dev/mpi_ring */
+struct mpi_ring_req {
+    pid_t peer;             /* registered process allowed to attach */
+    unsigned int size;      /* bytes of data area, rounded up to pages */
+};
+
+/*
+ * First page of a mapped ring; the data area starts one page in. The kernel
+ * only initializes it, head and tail are advanced by the two processes.
+ */
+struct mpi_ring_header {
+    volatile unsigned int head;     /* next data offset the sender writes */
+    volatile unsigned int tail;     /* next data offset the receiver reads */
+    unsigned int size;              /* bytes in the data area */
+};
+
+#define MPI_RING_MAX_SIZE (4 * 1024 * 1024)
+
+#define MPI_RING_CREATE _IOW('M', 1, struct mpi_ring_req)
+#define MPI_RING_ATTACH _IO('M', 2)     /* the peer pid is the argument itself */
+
+/* Limits on messages queued for a process, see sys_mpi_quota() */
+struct mpi_quota {
+    int max_msgs;           /* messages queued for us, 0 = unlimited */
+    long max_bytes;         /* payload bytes queued for us, 0 = unlimited */
+    int max_pair_msgs;      /* same two limits, per sender */
+    long max_pair_bytes;
+    int flags;              /* MPI_QUOTA_BLOCK */
+    int queued_msgs;        /* current occupancy, only reported */
+    long queued_bytes;
+};
+
+/* Our sends to a full receiver sleep instead of failing with -EAGAIN */
+#define MPI_QUOTA_BLOCK 1
+
+/* Byte limit a process starts with when it registers */
+#define MPI_DEFAULT_MAX_BYTES (16 * 1024 * 1024)
+
+/* Convert a millisecond timeout to jiffies, rounding up; negative means forever */
+static inline long mpi_timeout_to_jiffies(long timeout_ms)
+{
+    if (timeout_ms < 0 || timeout_ms >= MAX_SCHEDULE_TIMEOUT / HZ)
+        return MAX_SCHEDULE_TIMEOUT;
+    return (timeout_ms * HZ + 999) / 1000;
+}
+
+int mpi_reserve_watched_pids(int npids);
+void mpi_set_watched(int npids);
+void mpi_sort_pids(pid_t *pids, int npids);
+struct pid_queue *mpi_find_pid_queue(struct mpi_mailbox *mb, pid_t sender_pid);
+struct mpi_mailbox *mpi_alloc_mailbox(int shared);
+void mpi_put_mailbox(struct mpi_mailbox *mb);
+void mpi_attach_mailbox(task_t *p, struct mpi_mailbox *mb);
+void mpi_release_mailbox(task_t *p);
+void mpi_exit(task_t *p);
+void mpi_fork(task_t *p, unsigned long clone_flags);
+int sys_mpi_register_ex(int flags);
+int mpi_get_receiver(pid_t pid, struct mpi_mailbox **mbp);
+int mpi_pollset_notify(task_t *p, pid_t sender_pid);
+void mpi_free_pollset(task_t *p);
+struct pid_queue *mpi_alloc_pid_queue(void);
+void mpi_free_pid_queue(struct pid_queue *pq);
+struct message_node *mpi_alloc_message(ssize_t message_size);
+struct mpi_buffer *mpi_alloc_buffer(ssize_t size);
+void mpi_put_buffer(struct mpi_buffer *buffer);
+struct message_node *mpi_alloc_shared_message(struct mpi_buffer *buffer, ssize_t offset, ssize_t message_size);
+void mpi_free_message(struct message_node *mn);
+
 #endif
@@ -358,9 +358,14 @@ struct task_struct {
 /* task state */
 	pid_t* watched_pids;
 	pid_t  sender_pid;
-	int num_watched_pids;
+	int num_watched_pids;		/* non-zero only while waiting on mpi_wait */
+	int max_watched_pids;		/* allocated length of watched_pids */
 	unsigned int mpi_registered;
-	list_t l_queue_by_pid;
+	struct mpi_mailbox *mpi_mailbox;	/* our queues, maybe shared by the thread group */
+	list_t l_mpi_mailbox;		/* link in mpi_mailbox->tasks */
+	wait_queue_head_t mpi_wait;	/* for blocking mpi receivers */
+	struct mpi_pollset *mpi_pollset;
+	int mpi_quota_flags;		/* MPI_QUOTA_BLOCK */
 	struct linux_binfmt *binfmt;
 	int exit_code, exit_signal;
 	int pdeath_signal;  /*  The signal sent when the parent dies  */
@@ -533,8 +538,13 @@ extern struct exec_domain	default_exec_domain;
     watched_pids: NULL,							\
     sender_pid: 0,							\
     num_watched_pids: 0,						\
+    max_watched_pids: 0,						\
     mpi_registered: 0,							\
-    l_queue_by_pid: LIST_HEAD_INIT(tsk.l_queue_by_pid),			\
+    mpi_mailbox: NULL,							\
+    l_mpi_mailbox: LIST_HEAD_INIT(tsk.l_mpi_mailbox),			\
+    mpi_wait:	__WAIT_QUEUE_HEAD_INITIALIZER(tsk.mpi_wait),		\
+    mpi_pollset: NULL,							\
+    mpi_quota_flags: 0,							\
     cpus_allowed:	-1,						\
     cpus_allowed_mask:	-1,						\
     mm:			NULL,						\
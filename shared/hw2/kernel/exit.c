@@ -40,22 +40,8 @@ static void release_task(struct task_struct * p)
 	free_uid(p->user);
 	unhash_process(p);
 
-	//release mpi dynamically allocated memory
-	list_t *pq_it; //current pid_queue iterator
-	list_t *pq_it_n; //current pid_queue iterator
-	list_t *mn_it; //current message_node iterator
-	list_t *mn_it_n; //current message_node iterator
-	struct pid_queue *cur_pq;
-	struct message_node *cur_mn;
-	list_for_each_safe(pq_it,pq_it_n,&p->l_queue_by_pid){
-		cur_pq = (struct pid_queue*)list_entry(pq_it,struct pid_queue,l_idx);
-		list_for_each_safe(mn_it,mn_it_n,&cur_pq->messages){
-			cur_mn = (struct message_node*)list_entry(mn_it,struct message_node,l_idx);
-			kfree(cur_mn->message);
-			kfree(cur_mn);
-		}
-		kfree(cur_pq);
-	}
+	//mpi state is normally gone already, see do_exit
+	mpi_exit(p);
 
 
 	release_thread(p);
@@ -537,6 +523,8 @@ fake_volatile:
 	__exit_files(tsk);
 	__exit_fs(tsk);
 	exit_namespace(tsk);
+	//leave the mpi mailbox now so senders stop targeting us
+	mpi_exit(tsk);
 	exit_sighand(tsk);
 	exit_thread();
 
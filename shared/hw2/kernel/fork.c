@@ -23,6 +23,7 @@
 #include <linux/personality.h>
 #include <linux/compiler.h>
 #include <linux/mman.h>
+#include <linux/mpi.h>
 
 #include <asm/pgtable.h>
 #include <asm/pgalloc.h>
@@ -613,9 +614,17 @@ int do_fork(unsigned long clone_flags, unsigned long stack_start,
 
 	*p = *current;
 
-	//mpi fork logic
-	p->l_queue_by_pid.next = &p->l_queue_by_pid;
-	p->l_queue_by_pid.prev = &p->l_queue_by_pid;
+	//mpi fork logic, the mailbox is attached once the child is hashed
+	p->mpi_registered = 0;
+	p->mpi_mailbox = NULL;
+	INIT_LIST_HEAD(&p->l_mpi_mailbox);
+	init_waitqueue_head(&p->mpi_wait);
+	p->watched_pids = NULL;
+	p->sender_pid = 0;
+	p->num_watched_pids = 0;
+	p->max_watched_pids = 0;
+	p->mpi_pollset = NULL;
+	p->mpi_quota_flags = 0;	/* mpi_fork() copies it if the child is registered */
 
 
 	p->tux_info = NULL;
@@ -778,6 +787,10 @@ int do_fork(unsigned long clone_flags, unsigned long stack_start,
 	nr_threads++;
 	write_unlock_irq(&tasklist_lock);
 
+	//threads join a shared mpi mailbox, other children of a registered
+	//task start registered unless it asked otherwise, see mpi_fork
+	mpi_fork(p, clone_flags);
+
 	if (p->ptrace & PT_PTRACED)
 		send_sig(SIGSTOP, p, 1);
 	wake_up_forked_process(p);	/* do this last */
@@ -1,21 +1,640 @@
 #include <linux/kernel.h>
+#include <linux/init.h>
 #include <linux/sched.h>
 #include <asm/current.h>
 #include <asm/uaccess.h>
 #include <linux/list.h>
 #include <linux/slab.h>
+#include <linux/tqueue.h>
 #include <linux/mpi.h>
 
+struct mpi_stats mpi_stats[NR_CPUS] __cacheline_aligned;
+
+// Cache for per-sender queues
+static kmem_cache_t *mpi_pid_queue_cachep;
+// Cache for messages whose payload fits in MPI_SMALL_MESSAGE_SIZE bytes
+static kmem_cache_t *mpi_message_cachep;
+// Cache for header-only messages whose payload is in a shared buffer
+static kmem_cache_t *mpi_shared_message_cachep;
+// Cache for per-sender, per-tag queues
+static kmem_cache_t *mpi_tag_queue_cachep;
+
+static int __init mpi_init(void) {
+    mpi_pid_queue_cachep = kmem_cache_create("mpi_pid_queue", sizeof(struct pid_queue),
+                                             0, SLAB_HWCACHE_ALIGN, NULL, NULL);
+    if (!mpi_pid_queue_cachep)
+        panic("Cannot create mpi_pid_queue SLAB cache");
+    mpi_message_cachep = kmem_cache_create("mpi_message",
+                                           sizeof(struct message_node) + MPI_SMALL_MESSAGE_SIZE,
+                                           0, SLAB_HWCACHE_ALIGN, NULL, NULL);
+    if (!mpi_message_cachep)
+        panic("Cannot create mpi_message SLAB cache");
+    mpi_shared_message_cachep = kmem_cache_create("mpi_shared_message", sizeof(struct message_node),
+                                                  0, SLAB_HWCACHE_ALIGN, NULL, NULL);
+    if (!mpi_shared_message_cachep)
+        panic("Cannot create mpi_shared_message SLAB cache");
+    mpi_tag_queue_cachep = kmem_cache_create("mpi_tag_queue", sizeof(struct mpi_tag_queue),
+                                             0, 0, NULL, NULL);
+    if (!mpi_tag_queue_cachep)
+        panic("Cannot create mpi_tag_queue SLAB cache");
+    return 0;
+}
+__initcall(mpi_init);
+
+// Allocate an empty per-sender queue
+struct pid_queue *mpi_alloc_pid_queue(void) {
+    return kmem_cache_alloc(mpi_pid_queue_cachep, GFP_KERNEL);
+}
+
+// Free a per-sender queue allocated by mpi_alloc_pid_queue()
+void mpi_free_pid_queue(struct pid_queue *pq) {
+    kmem_cache_free(mpi_pid_queue_cachep, pq);
+}
+
+// Allocate a message node with message_size bytes of inline payload
+struct message_node *mpi_alloc_message(ssize_t message_size) {
+    struct message_node *mn;
+
+    if (message_size <= MPI_SMALL_MESSAGE_SIZE)
+        mn = kmem_cache_alloc(mpi_message_cachep, GFP_KERNEL);
+    else
+        mn = kmalloc(sizeof(struct message_node) + message_size, GFP_KERNEL);
+    if (mn) {
+        mn->message_size = message_size;
+        mn->tag = 0;
+        mn->data = mn->message;
+        mn->buffer = NULL;
+    }
+    return mn;
+}
+
+// Allocate a payload of size bytes to be shared by several messages
+struct mpi_buffer *mpi_alloc_buffer(ssize_t size) {
+    struct mpi_buffer *buffer = kmalloc(sizeof(struct mpi_buffer) + size, GFP_KERNEL);
+
+    if (buffer)
+        atomic_set(&buffer->count, 1);
+    return buffer;
+}
+
+// Drop a reference to a shared payload, freeing it with the last one
+void mpi_put_buffer(struct mpi_buffer *buffer) {
+    if (atomic_dec_and_test(&buffer->count))
+        kfree(buffer);
+}
+
+// Allocate a message node for the message_size bytes at offset in buffer,
+// taking a reference to it. The node holds no payload and comes from a
+// cache of its own.
+struct message_node *mpi_alloc_shared_message(struct mpi_buffer *buffer, ssize_t offset, ssize_t message_size) {
+    struct message_node *mn = kmem_cache_alloc(mpi_shared_message_cachep, GFP_KERNEL);
+
+    if (mn) {
+        mn->message_size = message_size;
+        mn->tag = 0;
+        mn->data = buffer->data + offset;
+        mn->buffer = buffer;
+        atomic_inc(&buffer->count);
+    }
+    return mn;
+}
+
+// Free a message node allocated by mpi_alloc_message() or
+// mpi_alloc_shared_message()
+void mpi_free_message(struct message_node *mn) {
+    if (mn->buffer) {
+        mpi_put_buffer(mn->buffer);
+        kmem_cache_free(mpi_shared_message_cachep, mn);
+    } else if (mn->message_size <= MPI_SMALL_MESSAGE_SIZE)
+        kmem_cache_free(mpi_message_cachep, mn);
+    else
+        kfree(mn);
+}
+
+// Free a list of pid_queues, linked by l_idx, with all their messages
+static void mpi_free_queues(list_t *queues) {
+    list_t *pq_it, *pq_it_n, *mn_it, *mn_it_n, *tq_it, *tq_it_n;
+    struct pid_queue *pq;
+    int i;
+
+    list_for_each_safe(pq_it, pq_it_n, queues) {
+        pq = list_entry(pq_it, struct pid_queue, l_idx);
+        list_for_each_safe(mn_it, mn_it_n, &pq->messages)
+            mpi_free_message(list_entry(mn_it, struct message_node, l_idx));
+        for (i = 0; i < MPI_TAG_HASH_SIZE; ++i) {
+            list_for_each_safe(tq_it, tq_it_n, &pq->tag_hash[i])
+                kmem_cache_free(mpi_tag_queue_cachep, list_entry(tq_it, struct mpi_tag_queue, l_hash));
+        }
+        mpi_free_pid_queue(pq);
+        if (current->need_resched)
+            schedule();
+    }
+}
+
+// Queues of dead mailboxes too big to free in the exit path, freed by keventd
+static LIST_HEAD(mpi_dead_queues);
+static spinlock_t mpi_dead_lock = SPIN_LOCK_UNLOCKED;
+
+static void mpi_reap_queues(void *unused) {
+    LIST_HEAD(dead);
+
+    spin_lock(&mpi_dead_lock);
+    list_add(&dead, &mpi_dead_queues);
+    list_del_init(&mpi_dead_queues);
+    spin_unlock(&mpi_dead_lock);
+    mpi_free_queues(&dead);
+}
+
+static struct tq_struct mpi_reap_task = {
+    routine:    mpi_reap_queues,
+};
+
+// Allocate an empty mailbox with the default quota, used by one task
+struct mpi_mailbox *mpi_alloc_mailbox(int shared) {
+    struct mpi_mailbox *mb = kmalloc(sizeof(struct mpi_mailbox), GFP_KERNEL);
+    int i;
+
+    if (!mb)
+        return NULL;
+    spin_lock_init(&mb->lock);
+    atomic_set(&mb->count, 1);
+    mb->users = 0;
+    mb->shared = shared;
+    mb->inherit = 1;
+    INIT_LIST_HEAD(&mb->tasks);
+    INIT_LIST_HEAD(&mb->l_queue_by_pid);
+    for (i = 0; i < MPI_QUEUE_HASH_MIN; ++i)
+        INIT_LIST_HEAD(&mb->queue_hash_inline[i]);
+    mb->queue_hash = mb->queue_hash_inline;
+    mb->queue_hash_size = MPI_QUEUE_HASH_MIN;
+    mb->nr_queues = 0;
+    mb->max_msgs = 0;
+    mb->max_bytes = MPI_DEFAULT_MAX_BYTES;
+    mb->max_pair_msgs = 0;
+    mb->max_pair_bytes = 0;
+    mb->queued_msgs = 0;
+    mb->queued_bytes = 0;
+    mb->reduce = NULL;
+    init_waitqueue_head(&mb->reduce_wait);
+    init_waitqueue_head(&mb->space_wait);
+    return mb;
+}
+
+// Drop a reference to a mailbox, freeing it with the last one
+void mpi_put_mailbox(struct mpi_mailbox *mb) {
+    if (!atomic_dec_and_test(&mb->count))
+        return;
+    if (mb->queue_hash != mb->queue_hash_inline)
+        kfree(mb->queue_hash);
+    kfree(mb->reduce);
+    kfree(mb);
+}
+
+static inline list_t *mpi_queue_bucket(struct mpi_mailbox *mb, pid_t sender_pid) {
+    return &mb->queue_hash[(unsigned int)sender_pid & (mb->queue_hash_size - 1)];
+}
+
+// Link a new sender queue into mb; caller holds mb->lock. Returns non-zero
+// if the sender hash has become crowded and should grow.
+static int mpi_add_pid_queue(struct mpi_mailbox *mb, struct pid_queue *pq) {
+    // New senders wait their turn behind the others, see sys_mpi_receive_any
+    list_add_tail(&pq->l_idx, &mb->l_queue_by_pid);
+    list_add(&pq->l_hash, mpi_queue_bucket(mb, pq->sender_pid));
+    return ++mb->nr_queues > mb->queue_hash_size && mb->queue_hash_size < MPI_QUEUE_HASH_MAX;
+}
+
+// Unlink a drained sender queue from mb and free it; caller holds mb->lock
+static void mpi_del_pid_queue(struct mpi_mailbox *mb, struct pid_queue *pq) {
+    list_del(&pq->l_idx);
+    list_del(&pq->l_hash);
+    mb->nr_queues--;
+    mpi_free_pid_queue(pq);
+}
+
+// Double mb's sender hash until it has at least one bucket per queue. The
+// table is allocated without the lock; if that fails lookups just stay
+// slower. The hash never shrinks.
+static void mpi_grow_queue_hash(struct mpi_mailbox *mb) {
+    list_t *table, *old;
+    list_t *q_it;
+    struct pid_queue *pq;
+    int size, i;
+
+    size = mb->queue_hash_size;
+    while (size < mb->nr_queues && size < MPI_QUEUE_HASH_MAX)
+        size *= 2;
+    table = kmalloc(sizeof(list_t) * size, GFP_KERNEL);
+    if (!table)
+        return;
+    for (i = 0; i < size; ++i)
+        INIT_LIST_HEAD(&table[i]);
+
+    spin_lock(&mb->lock);
+    if (mb->queue_hash_size >= size) {
+        // Someone else grew it meanwhile
+        spin_unlock(&mb->lock);
+        kfree(table);
+        return;
+    }
+    old = mb->queue_hash;
+    mb->queue_hash = table;
+    mb->queue_hash_size = size;
+    list_for_each(q_it, &mb->l_queue_by_pid) {
+        pq = list_entry(q_it, struct pid_queue, l_idx);
+        list_add(&pq->l_hash, mpi_queue_bucket(mb, pq->sender_pid));
+    }
+    spin_unlock(&mb->lock);
+
+    if (old != mb->queue_hash_inline)
+        kfree(old);
+}
+
+// Make p a user of mb; the caller's reference to mb becomes p's
+void mpi_attach_mailbox(task_t *p, struct mpi_mailbox *mb) {
+    spin_lock(&mb->lock);
+    mb->users++;
+    list_add_tail(&p->l_mpi_mailbox, &mb->tasks);
+    spin_unlock(&mb->lock);
+    p->mpi_mailbox = mb;
+    // Senders look at mpi_registered before following mpi_mailbox
+    wmb();
+    p->mpi_registered = 1;
+}
+
+// Detach an exiting task from its mailbox. The last user frees the queued
+// messages, handing big backlogs to keventd, and senders blocked on the
+// quota see the mailbox is gone.
+void mpi_release_mailbox(task_t *p) {
+    struct mpi_mailbox *mb = p->mpi_mailbox;
+    LIST_HEAD(dead);
+    int last, i;
+    int nr_msgs = 0;
+
+    if (!mb)
+        return;
+    // Senders and sibling threads pin p->mpi_mailbox under the read side
+    write_lock_irq(&tasklist_lock);
+    p->mpi_registered = 0;
+    p->mpi_mailbox = NULL;
+    write_unlock_irq(&tasklist_lock);
+
+    spin_lock(&mb->lock);
+    list_del(&p->l_mpi_mailbox);
+    last = --mb->users == 0;
+    if (last) {
+        // Take the whole queue list over and free it outside the lock
+        list_add(&dead, &mb->l_queue_by_pid);
+        list_del_init(&mb->l_queue_by_pid);
+        for (i = 0; i < mb->queue_hash_size; ++i)
+            INIT_LIST_HEAD(&mb->queue_hash[i]);
+        mb->nr_queues = 0;
+        nr_msgs = mb->queued_msgs;
+    }
+    spin_unlock(&mb->lock);
+
+    if (last) {
+        wake_up(&mb->space_wait);
+        if (nr_msgs > MPI_REAP_INLINE_MSGS) {
+            spin_lock(&mpi_dead_lock);
+            list_splice(&dead, &mpi_dead_queues);
+            spin_unlock(&mpi_dead_lock);
+            schedule_task(&mpi_reap_task);
+        } else {
+            mpi_free_queues(&dead);
+        }
+    }
+    mpi_put_mailbox(mb);
+}
+
+// Tear down the MPI state of an exiting task. Called from do_exit(), so the
+// task leaves its mailbox and the receivers senders notify as soon as it
+// dies rather than when its parent reaps it; release_task() calls it again
+// as a no-op.
+void mpi_exit(task_t *p) {
+    mpi_release_mailbox(p);
+    kfree(p->watched_pids);
+    p->watched_pids = NULL;
+    p->num_watched_pids = 0;
+    p->max_watched_pids = 0;
+    mpi_free_pollset(p);
+}
+
+// Give the new child p of a registered task its mailbox; called by do_fork()
+// once p is hashed. Threads join a shared mailbox. Other children start
+// registered with an empty mailbox of their own and the parent's quota, so a
+// launcher can pre-register all its ranks by forking, unless the parent
+// registered with MPI_REGISTER_NOINHERIT. Registration is kept across exec.
+void mpi_fork(task_t *p, unsigned long clone_flags) {
+    struct mpi_mailbox *parent_mb = current->mpi_mailbox;
+    struct mpi_mailbox *mb;
+
+    if (!parent_mb) {
+        return;
+    }
+    // A registered child sends the way its parent does
+    if ((clone_flags & CLONE_THREAD) && parent_mb->shared) {
+        p->mpi_quota_flags = current->mpi_quota_flags;
+        atomic_inc(&parent_mb->count);
+        mpi_attach_mailbox(p, parent_mb);
+        return;
+    }
+    if (!parent_mb->inherit) {
+        return;
+    }
+    // If this fails the child just starts unregistered
+    mb = mpi_alloc_mailbox(0);
+    if (!mb) {
+        return;
+    }
+    spin_lock(&parent_mb->lock);
+    mb->max_msgs = parent_mb->max_msgs;
+    mb->max_bytes = parent_mb->max_bytes;
+    mb->max_pair_msgs = parent_mb->max_pair_msgs;
+    mb->max_pair_bytes = parent_mb->max_pair_bytes;
+    spin_unlock(&parent_mb->lock);
+    p->mpi_quota_flags = current->mpi_quota_flags;
+    mpi_attach_mailbox(p, mb);
+}
+
 // Register the current process for MPI communication
 int sys_mpi_register(void) {
-    // Mark the current process as registered for MPI
-    current->mpi_registered = 1;
-    // Initialize the list head for the message queue
-    current->l_queue_by_pid.next = &current->l_queue_by_pid;
-    current->l_queue_by_pid.prev = &current->l_queue_by_pid;
+    return sys_mpi_register_ex(0);
+}
+
+// Register the current task for MPI communication. With MPI_REGISTER_TGID
+// the task shares one mailbox with every thread of its group registered the
+// same way: a message sent to any of them can be received by all of them,
+// and their own messages are filed under the tgid at the receiver.
+int sys_mpi_register_ex(int flags) {
+    struct mpi_mailbox *mb = NULL;
+    struct mpi_mailbox *group_mb = NULL;
+    int shared = (flags & MPI_REGISTER_TGID) != 0;
+    int inherit = (flags & MPI_REGISTER_NOINHERIT) == 0;
+    int res = 0;
+    task_t *t;
+
+    if (flags & ~(MPI_REGISTER_TGID | MPI_REGISTER_NOINHERIT)) {
+        return -EINVAL;
+    }
+    // Registering again is a no-op, but the mode cannot change
+    mb = current->mpi_mailbox;
+    if (mb) {
+        return mb->shared == shared && mb->inherit == inherit ? 0 : -EBUSY;
+    }
+    mb = mpi_alloc_mailbox(shared);
+    if (!mb) {
+        return -ENOMEM;
+    }
+    mb->inherit = inherit;
+    if (!shared) {
+        mpi_attach_mailbox(current, mb);
+        return 0;
+    }
+    // Join the mailbox of a thread that registered the group before us, or
+    // publish ours. Looking and attaching under the write lock keeps two
+    // threads registering at once from each attaching a mailbox of its own.
+    write_lock_irq(&tasklist_lock);
+    for_each_thread(t) {
+        if (t->mpi_mailbox && t->mpi_mailbox->shared) {
+            group_mb = t->mpi_mailbox;
+            break;
+        }
+    }
+    if (!group_mb) {
+        mpi_attach_mailbox(current, mb);
+    } else if (group_mb->inherit == inherit) {
+        atomic_inc(&group_mb->count);
+        mpi_attach_mailbox(current, group_mb);
+    } else {
+        res = -EBUSY;
+    }
+    write_unlock_irq(&tasklist_lock);
+    if (group_mb) {
+        mpi_put_mailbox(mb);
+    }
+    return res;
+}
+
+// Check whether mb has room for a message_size bytes message from
+// sender_pid; caller holds mb->lock. Returns 0 if it fits, -EAGAIN if the
+// mailbox is full and -EMSGSIZE if the message is larger than its limits
+// allow at all.
+static int mpi_quota_check(struct mpi_mailbox *mb, pid_t sender_pid, ssize_t message_size) {
+    struct pid_queue *pq = mpi_find_pid_queue(mb, sender_pid);
+    int pair_msgs = pq ? pq->count : 0;
+    ssize_t pair_bytes = pq ? pq->bytes : 0;
+
+    if ((mb->max_bytes && message_size > mb->max_bytes) ||
+        (mb->max_pair_bytes && message_size > mb->max_pair_bytes)) {
+        return -EMSGSIZE;
+    }
+    // With no byte limit only the width of the counters bounds the totals
+    if (mb->queued_bytes > LONG_MAX - message_size || pair_bytes > LONG_MAX - message_size) {
+        return -EAGAIN;
+    }
+    if ((mb->max_msgs && mb->queued_msgs >= mb->max_msgs) ||
+        (mb->max_bytes && mb->queued_bytes + message_size > mb->max_bytes) ||
+        (mb->max_pair_msgs && pair_msgs >= mb->max_pair_msgs) ||
+        (mb->max_pair_bytes && pair_bytes + message_size > mb->max_pair_bytes)) {
+        return -EAGAIN;
+    }
     return 0;
 }
 
+// Sleep until mb has room for a message_size bytes message from sender_pid
+// or its last user exits. The caller holds a reference to mb but not its
+// lock, and must check the quota again. Returns -EINTR if a signal arrives.
+static int mpi_wait_for_space(struct mpi_mailbox *mb, pid_t sender_pid, ssize_t message_size) {
+    DECLARE_WAITQUEUE(wait, current);
+    int res;
+
+    add_wait_queue(&mb->space_wait, &wait);
+    for (;;) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        spin_lock(&mb->lock);
+        res = mb->users ? mpi_quota_check(mb, sender_pid, message_size) : -EPERM;
+        spin_unlock(&mb->lock);
+        if (res != -EAGAIN) {
+            res = 0;
+            break;
+        }
+        if (signal_pending(current)) {
+            res = -EINTR;
+            break;
+        }
+        schedule();
+    }
+    set_current_state(TASK_RUNNING);
+    remove_wait_queue(&mb->space_wait, &wait);
+    return res;
+}
+
+// Make sure current->watched_pids can hold npids entries. The array is kept
+// across calls and only reallocated when it has to grow. Senders only read
+// it while num_watched_pids is set, which is never the case here.
+int mpi_reserve_watched_pids(int npids) {
+    pid_t *watched;
+
+    if (current->max_watched_pids >= npids)
+        return 0;
+    watched = kmalloc(sizeof(pid_t) * npids, GFP_KERNEL);
+    if (!watched)
+        return -ENOMEM;
+    kfree(current->watched_pids);
+    current->watched_pids = watched;
+    current->max_watched_pids = npids;
+    return 0;
+}
+
+// Sort a pid array in ascending order (shell sort, no allocation)
+void mpi_sort_pids(pid_t *pids, int npids) {
+    int gap, i, j;
+    pid_t tmp;
+
+    for (gap = npids / 2; gap > 0; gap /= 2) {
+        for (i = gap; i < npids; ++i) {
+            tmp = pids[i];
+            for (j = i; j >= gap && pids[j - gap] > tmp; j -= gap)
+                pids[j] = pids[j - gap];
+            pids[j] = tmp;
+        }
+    }
+}
+
+// Check whether p is currently waiting for messages from pid, by binary
+// search over its sorted watch set; caller holds p's mailbox lock
+static int mpi_is_watched(task_t *p, pid_t pid) {
+    int lo = 0, hi = p->num_watched_pids - 1, mid;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (p->watched_pids[mid] == pid)
+            return 1;
+        if (p->watched_pids[mid] < pid)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return 0;
+}
+
+// Find the queue of messages from sender_pid in mb, or NULL if there is none;
+// caller holds mb->lock
+struct pid_queue *mpi_find_pid_queue(struct mpi_mailbox *mb, pid_t sender_pid) {
+    struct pid_queue *pq;
+    list_t *q_it;
+
+    list_for_each(q_it, mpi_queue_bucket(mb, sender_pid)) {
+        pq = list_entry(q_it, struct pid_queue, l_hash);
+        if (pq->sender_pid == sender_pid)
+            return pq;
+    }
+    return NULL;
+}
+
+// Check whether mb has a queued message from sender_pid
+static int mpi_message_pending(struct mpi_mailbox *mb, pid_t sender_pid) {
+    struct pid_queue *pq;
+    int pending;
+
+    spin_lock(&mb->lock);
+    pq = mpi_find_pid_queue(mb, sender_pid);
+    pending = pq && pq->count > 0;
+    spin_unlock(&mb->lock);
+    return pending;
+}
+
+// Publish or retire the current task's watch set of npids pids
+void mpi_set_watched(int npids) {
+    struct mpi_mailbox *mb = current->mpi_mailbox;
+
+    spin_lock(&mb->lock);
+    current->num_watched_pids = npids;
+    spin_unlock(&mb->lock);
+}
+
+static inline list_t *mpi_tag_bucket(struct pid_queue *pq, int tag) {
+    return &pq->tag_hash[(unsigned int)tag & (MPI_TAG_HASH_SIZE - 1)];
+}
+
+// Find the queue of pq's messages tagged tag, or NULL if there are none;
+// caller holds mb->lock
+static struct mpi_tag_queue *mpi_find_tag_queue(struct pid_queue *pq, int tag) {
+    struct mpi_tag_queue *tq;
+    list_t *it;
+
+    list_for_each(it, mpi_tag_bucket(pq, tag)) {
+        tq = list_entry(it, struct mpi_tag_queue, l_hash);
+        if (tq->tag == tag)
+            return tq;
+    }
+    return NULL;
+}
+
+// Find the oldest message tagged tag in pq, or NULL if there is none; caller
+// holds mb->lock
+static struct message_node *mpi_find_tagged(struct pid_queue *pq, int tag) {
+    struct mpi_tag_queue *tq = mpi_find_tag_queue(pq, tag);
+
+    return tq ? list_entry(tq->messages.next, struct message_node, l_tag) : NULL;
+}
+
+// Unlink message_node_ptr from sender_queue in mb; the queue and the tag
+// queue are freed once they are drained. Caller holds mb->lock.
+static void mpi_unlink_message(struct mpi_mailbox *mb, struct pid_queue *sender_queue, struct message_node *message_node_ptr) {
+    list_t *message_list = &sender_queue->messages;
+    struct mpi_tag_queue *tq = message_node_ptr->tag_queue;
+
+    // Remove the message from the queue and its tag queue
+    list_del(&message_node_ptr->l_idx);
+    list_del(&message_node_ptr->l_tag);
+    if (list_empty(&tq->messages)) {
+        list_del(&tq->l_hash);
+        kmem_cache_free(mpi_tag_queue_cachep, tq);
+    }
+    sender_queue->count--;
+    sender_queue->bytes -= message_node_ptr->message_size;
+    mb->queued_msgs--;
+    mb->queued_bytes -= message_node_ptr->message_size;
+
+    // If no messages are left from this sender, remove the sender's queue
+    if (list_empty(message_list)) {
+        mpi_del_pid_queue(mb, sender_queue);
+    }
+}
+
+// Unlink the oldest message of sender_queue, which must not be empty, from
+// mb; the queue is freed once it is drained. Caller holds mb->lock.
+static struct message_node *mpi_dequeue(struct mpi_mailbox *mb, struct pid_queue *sender_queue) {
+    struct message_node *mn = list_entry(sender_queue->messages.next, struct message_node, l_idx);
+
+    mpi_unlink_message(mb, sender_queue, mn);
+    return mn;
+}
+
+// Copy a message taken off mb by mpi_dequeue() to the user buffer and free
+// it. The message is dropped even if the copy faults.
+static int mpi_deliver(struct mpi_mailbox *mb, struct message_node *message_node_ptr, char* user_buffer, ssize_t buffer_length) {
+    // Determine the size to copy
+    ssize_t return_length = message_node_ptr->message_size < buffer_length ? message_node_ptr->message_size : buffer_length;
+    // Copy the message to the user buffer
+    int copy_status = copy_to_user(user_buffer, message_node_ptr->data, return_length);
+    unsigned long latency = mpi_usecs_since(&message_node_ptr->stamp);
+    mpi_free_message(message_node_ptr);
+
+    // Let senders blocked on our quota retry
+    if (waitqueue_active(&mb->space_wait)) {
+        wake_up(&mb->space_wait);
+    }
+    if (copy_status) {
+        return -EFAULT;
+    }
+    MPI_STAT_INC(receives);
+    MPI_STAT_ADD(bytes_received, return_length);
+    MPI_STAT_INC(queue_latency[mpi_lat_bucket(latency)]);
+    return return_length;
+}
+
 // Receive a message from a specific sender process
 int sys_mpi_receive(pid_t sender_pid, char* user_buffer, ssize_t buffer_length) {
     // Validate input parameters
@@ -27,132 +646,599 @@ int sys_mpi_receive(pid_t sender_pid, char* user_buffer, ssize_t buffer_length)
         return -EPERM;
     }
     
-    struct pid_queue* sender_queue;
-    pid_t sender_pid_check;
-    list_t *message_list = NULL;
-    int is_found = 0;
-    list_t *iterator; // current queue iterator
-
-    // Iterate through the message queues to find the sender's queue
-    list_for_each(iterator, &current->l_queue_by_pid) {
-        sender_queue = list_entry(iterator, struct pid_queue, l_idx);
-        sender_pid_check = sender_queue->sender_pid;
-        if (sender_pid_check == sender_pid) {
-            is_found = 1;
-            message_list = &sender_queue->messages;
-            break;
+    // Find the sender's queue
+    struct mpi_mailbox *mb = current->mpi_mailbox;
+    struct message_node *mn;
+    spin_lock(&mb->lock);
+    struct pid_queue* sender_queue = mpi_find_pid_queue(mb, sender_pid);
+
+    // If no messages from the sender are found, return an error
+    if (!sender_queue || list_empty(&sender_queue->messages)) {
+        spin_unlock(&mb->lock);
+        MPI_STAT_INC(eagain);
+        return -EAGAIN;
+    }
+    mn = mpi_dequeue(mb, sender_queue);
+    spin_unlock(&mb->lock);
+    return mpi_deliver(mb, mn, user_buffer, buffer_length);
+}
+
+// Receive the oldest message of one of our non-empty sender queues, taking
+// the senders in turn: the queue served is moved to the tail of
+// l_queue_by_pid, and queues of new senders are added at the tail, so the
+// head is always the sender that waited longest. The sender's pid is stored
+// in *sender_pid.
+int sys_mpi_receive_any(pid_t *sender_pid, char* user_buffer, ssize_t buffer_length) {
+    struct mpi_mailbox *mb = current->mpi_mailbox;
+    struct pid_queue *sender_queue;
+    struct message_node *mn;
+    pid_t from;
+    int res;
+
+    if (buffer_length < 1 || user_buffer == NULL || sender_pid == NULL) {
+        return -EINVAL;
+    }
+    if (current->mpi_registered == 0) {
+        return -EPERM;
+    }
+    spin_lock(&mb->lock);
+    // Every queue on the list holds at least one message
+    if (list_empty(&mb->l_queue_by_pid)) {
+        spin_unlock(&mb->lock);
+        MPI_STAT_INC(eagain);
+        return -EAGAIN;
+    }
+    sender_queue = list_entry(mb->l_queue_by_pid.next, struct pid_queue, l_idx);
+    from = sender_queue->sender_pid;
+    list_del(&sender_queue->l_idx);
+    list_add_tail(&sender_queue->l_idx, &mb->l_queue_by_pid);
+    mn = mpi_dequeue(mb, sender_queue);
+    spin_unlock(&mb->lock);
+
+    res = mpi_deliver(mb, mn, user_buffer, buffer_length);
+    if (res >= 0 && put_user(from, sender_pid)) {
+        return -EFAULT;
+    }
+    return res;
+}
+
+// Receive the oldest message matching *sender_pid and *tag, either of which
+// may be a wildcard, and store the actual sender and tag in them. A given
+// sender and tag are found through the sender's queue for that tag;
+// with MPI_ANY_SOURCE the senders are tried in the round-robin order of
+// sys_mpi_receive_any, and the one served moves to the tail.
+int sys_mpi_receive_tag(pid_t *sender_pid, int *tag, char* user_buffer, ssize_t buffer_length) {
+    struct mpi_mailbox *mb = current->mpi_mailbox;
+    struct pid_queue *sender_queue = NULL;
+    struct message_node *mn = NULL;
+    pid_t from;
+    int want_tag;
+    list_t *q_it;
+    int res;
+
+    if (buffer_length < 1 || user_buffer == NULL || sender_pid == NULL || tag == NULL) {
+        return -EINVAL;
+    }
+    if (current->mpi_registered == 0) {
+        return -EPERM;
+    }
+    if (get_user(from, sender_pid) || get_user(want_tag, tag)) {
+        return -EFAULT;
+    }
+    if (want_tag < 0 && want_tag != MPI_ANY_TAG) {
+        return -EINVAL;
+    }
+
+    spin_lock(&mb->lock);
+    if (from != MPI_ANY_SOURCE) {
+        sender_queue = mpi_find_pid_queue(mb, from);
+        if (sender_queue) {
+            mn = want_tag == MPI_ANY_TAG ? list_entry(sender_queue->messages.next, struct message_node, l_idx)
+                                         : mpi_find_tagged(sender_queue, want_tag);
+        }
+    } else {
+        list_for_each(q_it, &mb->l_queue_by_pid) {
+            sender_queue = list_entry(q_it, struct pid_queue, l_idx);
+            mn = want_tag == MPI_ANY_TAG ? list_entry(sender_queue->messages.next, struct message_node, l_idx)
+                                         : mpi_find_tagged(sender_queue, want_tag);
+            if (mn) {
+                from = sender_queue->sender_pid;
+                list_del(&sender_queue->l_idx);
+                list_add_tail(&sender_queue->l_idx, &mb->l_queue_by_pid);
+                break;
+            }
         }
     }
-    // If no messages from the sender are found, return an error
-    if (is_found == 0 || list_empty(message_list)) {
+    if (!mn) {
+        spin_unlock(&mb->lock);
+        MPI_STAT_INC(eagain);
         return -EAGAIN;
     }
-    // Retrieve the first message from the sender's queue
-    struct message_node *message_node_ptr = (struct message_node*)list_entry(message_list->next, struct message_node, l_idx);
+    want_tag = mn->tag;
+    mpi_unlink_message(mb, sender_queue, mn);
+    spin_unlock(&mb->lock);
 
-    // Determine the size to copy
-    ssize_t return_length = message_node_ptr->message_size < buffer_length ? message_node_ptr->message_size : buffer_length;
-    // Copy the message to the user buffer
-    int copy_status = copy_to_user(user_buffer, message_node_ptr->message, return_length);
-    if (copy_status) {
+    res = mpi_deliver(mb, mn, user_buffer, buffer_length);
+    if (res >= 0 && (put_user(from, sender_pid) || put_user(want_tag, tag))) {
         return -EFAULT;
     }
-    // Remove the message from the queue and free the memory
-    list_del(&message_node_ptr->l_idx);
-    kfree(message_node_ptr->message);
-    kfree(message_node_ptr);
+    return res;
+}
 
-    // If no messages are left from this sender, remove the sender's queue
-    if (list_empty(message_list)) {
-        list_del(iterator);
-        kfree(sender_queue);
+// Return the size of the oldest message queued from sender_pid without
+// dequeuing it, so the caller can size its buffer before sys_mpi_receive;
+// -EAGAIN if nothing is queued
+int sys_mpi_probe(pid_t sender_pid) {
+    struct mpi_mailbox *mb = current->mpi_mailbox;
+    int res = -EAGAIN;
+
+    if (current->mpi_registered == 0) {
+        return -EPERM;
+    }
+    spin_lock(&mb->lock);
+    struct pid_queue *sender_queue = mpi_find_pid_queue(mb, sender_pid);
+    if (sender_queue && !list_empty(&sender_queue->messages)) {
+        res = list_entry(sender_queue->messages.next, struct message_node, l_idx)->message_size;
     }
+    spin_unlock(&mb->lock);
+    return res;
+}
 
-    return return_length;
+// Wake the users of mb that wait for a message from sender_pid and mark it
+// ready in their poll sets; caller holds mb->lock
+static void mpi_notify_receivers(struct mpi_mailbox *mb, pid_t sender_pid) {
+    task_t *t;
+    list_t *t_it;
+    int woken;
+
+    list_for_each(t_it, &mb->tasks) {
+        t = list_entry(t_it, task_t, l_mpi_mailbox);
+        woken = 0;
+        if (mpi_is_watched(t, sender_pid)) {
+            MPI_TRACE(KERN_INFO "ERANROI - Waking up receiver %d\n", t->pid);
+            t->sender_pid = sender_pid;
+            wake_up(&t->mpi_wait);
+            woken = 1;
+        }
+        if (t->mpi_pollset && mpi_pollset_notify(t, sender_pid)) {
+            woken = 1;
+        }
+        // Count a task once even if both its watch set and poll set match
+        if (woken) {
+            MPI_STAT_INC(wakeups);
+        }
+    }
 }
 
-// Send a message to a specific process
-int sys_mpi_send(pid_t pid, char *message, ssize_t message_size) {
-    printk(KERN_INFO "ERANROI - SEND: Entered sys_mpi_send\n");
-    if (message_size < 1 || message == NULL) {
-        printk(KERN_ERR "ERANROI - Invalid arguments: message_size = %zd, message = %p\n", message_size, message);
-        return -EINVAL;
+// Pin the mailbox of the registered task pid in *mbp. Returns -ESRCH if
+// there is no such task and -EPERM if it or the current task is not
+// registered.
+int mpi_get_receiver(pid_t pid, struct mpi_mailbox **mbp) {
+    struct mpi_mailbox *mb = NULL;
+    task_t *p;
+
+    // Everything goes through the receiver's mailbox, which may be shared
+    // by its thread group and outlive p; pin it while p is hashed
+    read_lock(&tasklist_lock);
+    p = find_task_by_pid(pid);
+    if (p && p->mpi_registered) {
+        rmb();
+        mb = p->mpi_mailbox;
+        atomic_inc(&mb->count);
     }
-    task_t *p = find_task_by_pid(pid);
+    read_unlock(&tasklist_lock);
     if (!p) {
-        printk(KERN_ERR "ERANROI - ESRCH: Could not find task with pid = %d\n", pid);
+        MPI_TRACE(KERN_ERR "ERANROI - ESRCH: Could not find task with pid = %d\n", pid);
         return -ESRCH;
     }
-    if (p->mpi_registered == 0 || current->mpi_registered == 0) {
-        printk(KERN_ERR "ERANROI - EPERM: Either sender or receiver not registered for MPI\n");
+    if (!mb || current->mpi_registered == 0) {
+        MPI_TRACE(KERN_ERR "ERANROI - EPERM: Either sender or receiver not registered for MPI\n");
+        if (mb)
+            mpi_put_mailbox(mb);
         return -EPERM;
     }
+    *mbp = mb;
+    return 0;
+}
+
+// Queue the staged message mn from the current task in mb, waiting for room
+// if our sends block, and wake the receivers watching us. mn is freed if it
+// cannot be queued.
+static int mpi_enqueue(struct mpi_mailbox *mb, struct message_node *mn) {
+    pid_t sender_pid = mpi_sender_id(current);
+    ssize_t message_size = mn->message_size;
     struct pid_queue *cur_pid_queue;
-    pid_t cur_sender_pid;
-    list_t *head_messages = NULL;
-    int found = 0;
-    list_t *q_it; // current queue iterator
-
-    printk(KERN_INFO "ERANROI - Iterating through receiver's l_queue_by_pid\n");
-    list_for_each(q_it, &p->l_queue_by_pid) {
-        cur_pid_queue = list_entry(q_it, struct pid_queue, l_idx);
-        cur_sender_pid = cur_pid_queue->sender_pid;
-        if (cur_sender_pid == current->pid) {
-            found = 1;
-            head_messages = &cur_pid_queue->messages;
+    struct pid_queue *spare = NULL;
+    struct mpi_tag_queue *tag_queue;
+    struct mpi_tag_queue *spare_tag_queue = NULL;
+    int grow = 0;
+    int res, i;
+
+    MPI_TRACE(KERN_INFO "ERANROI - Checking the receiver's quota\n");
+    spin_lock(&mb->lock);
+    for (;;) {
+        res = mb->users ? mpi_quota_check(mb, sender_pid, message_size) : -EPERM;
+        if (res == -EAGAIN && (current->mpi_quota_flags & MPI_QUOTA_BLOCK)) {
+            MPI_TRACE(KERN_INFO "ERANROI - Receiver is full, waiting for space\n");
+            spin_unlock(&mb->lock);
+            res = mpi_wait_for_space(mb, sender_pid, message_size);
+            spin_lock(&mb->lock);
+            if (res) {
+                break;
+            }
+            continue;
+        }
+        if (res) {
             break;
         }
-    }
-    if (found == 0) {
-        printk(KERN_INFO "ERANROI - Creating new pid_queue for sender\n");
-        struct pid_queue *pq = kmalloc(sizeof(struct pid_queue), GFP_KERNEL);
-        if (!pq) {
-            printk(KERN_ERR "ERANROI - ENOMEM: Could not allocate memory for pid_queue\n");
-            return -ENOMEM;
+
+        MPI_TRACE(KERN_INFO "ERANROI - Looking up our queues in the receiver\n");
+        cur_pid_queue = mpi_find_pid_queue(mb, sender_pid);
+        tag_queue = cur_pid_queue ? mpi_find_tag_queue(cur_pid_queue, mn->tag) : NULL;
+        if ((cur_pid_queue || spare) && (tag_queue || spare_tag_queue)) {
+            break;
+        }
+
+        // Allocate the queues with the lock dropped, then check again: the
+        // receiver may have filled up or exited in the meantime
+        spin_unlock(&mb->lock);
+        if (!cur_pid_queue && !spare) {
+            MPI_TRACE(KERN_INFO "ERANROI - Creating new pid_queue for sender\n");
+            spare = mpi_alloc_pid_queue();
+            if (!spare) {
+                MPI_TRACE(KERN_ERR "ERANROI - ENOMEM: Could not allocate memory for pid_queue\n");
+                res = -ENOMEM;
+                goto out_free;
+            }
+            spare->sender_pid = sender_pid;
+            spare->count = 0;
+            spare->bytes = 0;
+            spare->messages.next = &spare->messages;
+            spare->messages.prev = &spare->messages;
+            for (i = 0; i < MPI_TAG_HASH_SIZE; ++i) {
+                INIT_LIST_HEAD(&spare->tag_hash[i]);
+            }
+        }
+        if (!tag_queue && !spare_tag_queue) {
+            spare_tag_queue = kmem_cache_alloc(mpi_tag_queue_cachep, GFP_KERNEL);
+            if (!spare_tag_queue) {
+                MPI_TRACE(KERN_ERR "ERANROI - ENOMEM: Could not allocate memory for tag queue\n");
+                res = -ENOMEM;
+                goto out_free;
+            }
+            spare_tag_queue->tag = mn->tag;
+            INIT_LIST_HEAD(&spare_tag_queue->messages);
         }
-        pq->sender_pid = current->pid;
+        spin_lock(&mb->lock);
+    }
+    if (res) {
+        spin_unlock(&mb->lock);
+        if (res == -EAGAIN)
+            MPI_STAT_INC(eagain);
+        MPI_TRACE(KERN_ERR "ERANROI - %d: Receiver's quota does not admit the message\n", res);
+        goto out_free;
+    }
+    if (!cur_pid_queue) {
+        cur_pid_queue = spare;
+        spare = NULL;
+        grow = mpi_add_pid_queue(mb, cur_pid_queue);
+    }
+    if (!tag_queue) {
+        tag_queue = spare_tag_queue;
+        spare_tag_queue = NULL;
+        list_add(&tag_queue->l_hash, mpi_tag_bucket(cur_pid_queue, mn->tag));
+    }
+    list_add_tail(&mn->l_idx, &cur_pid_queue->messages);
+    list_add_tail(&mn->l_tag, &tag_queue->messages);
+    mn->tag_queue = tag_queue;
+    cur_pid_queue->count++;
+    cur_pid_queue->bytes += message_size;
+    mb->queued_msgs++;
+    mb->queued_bytes += message_size;
+    MPI_TRACE(KERN_INFO "ERANROI - Message added to receiver's message list\n");
+
+    MPI_TRACE(KERN_INFO "ERANROI - Checking if receivers watch us\n");
+    mpi_notify_receivers(mb, sender_pid);
+    spin_unlock(&mb->lock);
+    if (grow)
+        mpi_grow_queue_hash(mb);
+    MPI_STAT_INC(sends);
+    MPI_STAT_ADD(bytes_sent, message_size);
+    mn = NULL;
+    res = 0;
+
+out_free:
+    if (mn)
+        mpi_free_message(mn);
+    if (spare)
+        mpi_free_pid_queue(spare);
+    if (spare_tag_queue)
+        kmem_cache_free(mpi_tag_queue_cachep, spare_tag_queue);
+    return res;
+}
 
-        pq->messages.next = &pq->messages;
-        pq->messages.prev = &pq->messages;
+// Send a message tagged tag to a specific process
+static int mpi_send_tagged(pid_t pid, int tag, char *message, ssize_t message_size) {
+    struct mpi_mailbox *mb;
+    struct message_node *mn;
+    struct timeval start;
+    int res;
 
-        head_messages = &pq->messages;
-        list_add(&pq->l_idx, &p->l_queue_by_pid);
+    do_gettimeofday(&start);
+    MPI_TRACE(KERN_INFO "ERANROI - SEND: Entered sys_mpi_send\n");
+    if (message_size < 1 || message == NULL) {
+        MPI_TRACE(KERN_ERR "ERANROI - Invalid arguments: message_size = %zd, message = %p\n", message_size, message);
+        return -EINVAL;
+    }
+    res = mpi_get_receiver(pid, &mb);
+    if (res) {
+        return res;
     }
-    struct message_node *mn = kmalloc(sizeof(struct message_node), GFP_KERNEL);
+
+    // Stage the message outside the lock so a blocked or slow sender does
+    // not hold anything but its own copy
+    mn = mpi_alloc_message(message_size);
     if (!mn) {
-        printk(KERN_ERR "ERANROI - ENOMEM: Could not allocate memory for message_node\n");
-        return -ENOMEM;
+        MPI_TRACE(KERN_ERR "ERANROI - ENOMEM: Could not allocate memory for message_node\n");
+        res = -ENOMEM;
+        goto out;
     }
-    mn->message_size = message_size;
-    mn->message = kmalloc(message_size * sizeof(char), GFP_KERNEL);
-    if (!mn->message) {
-        printk(KERN_ERR "ERANROI - ENOMEM: Could not allocate memory for message\n");
-        kfree(mn);
+    mn->stamp = start;
+    mn->tag = tag;
+    if (copy_from_user(mn->data, message, message_size)) {
+        MPI_TRACE(KERN_ERR "ERANROI - EFAULT: Failed to copy message from user space\n");
+        mpi_free_message(mn);
+        res = -EFAULT;
+        goto out;
+    }
+
+    res = mpi_enqueue(mb, mn);
+    if (res == 0) {
+        MPI_STAT_INC(send_latency[mpi_lat_bucket(mpi_usecs_since(&start))]);
+    }
+out:
+    mpi_put_mailbox(mb);
+    return res;
+}
+
+// Send a message to a specific process
+int sys_mpi_send(pid_t pid, char *message, ssize_t message_size) {
+    return mpi_send_tagged(pid, 0, message, message_size);
+}
+
+// Send a message with a tag, which receivers can match on with
+// sys_mpi_receive_tag; plain sends are tagged 0
+int sys_mpi_send_tag(pid_t pid, int tag, char *message, ssize_t message_size) {
+    if (tag < 0) {
+        return -EINVAL;
+    }
+    return mpi_send_tagged(pid, tag, message, message_size);
+}
+
+// Send slices of one buffer, copied from user space once, to the n pids of
+// the user array pids: slice i is buf + i * stride, message_size bytes long.
+// All messages reference the same mpi_buffer. Stops at the first receiver
+// that cannot be sent to; returns the number of messages sent, or that
+// receiver's error if there are none.
+static int mpi_send_collective(pid_t *pids, int n, char *buf, ssize_t message_size, ssize_t stride) {
+    struct mpi_buffer *buffer;
+    struct mpi_mailbox *mb;
+    struct message_node *mn;
+    struct timeval start;
+    ssize_t total;
+    pid_t pid;
+    int sent = 0;
+    int res = 0;
+    int i;
+
+    do_gettimeofday(&start);
+    if (n < 1 || n > MPI_IOV_MAX || message_size < 1 || buf == NULL || pids == NULL) {
+        return -EINVAL;
+    }
+    if (n > 1 && stride > (INT_MAX - message_size) / (n - 1)) {
+        return -EINVAL;
+    }
+    if (current->mpi_registered == 0) {
+        return -EPERM;
+    }
+    total = stride * (n - 1) + message_size;
+    buffer = mpi_alloc_buffer(total);
+    if (!buffer) {
         return -ENOMEM;
     }
-    int fail_cp = copy_from_user(mn->message, message, message_size);
-    if (fail_cp) {
-        printk(KERN_ERR "ERANROI - EFAULT: Failed to copy message from user space\n");
-        kfree(mn->message);
-        kfree(mn);
+    if (copy_from_user(buffer->data, buf, total)) {
+        mpi_put_buffer(buffer);
         return -EFAULT;
     }
-    list_add_tail(&mn->l_idx, head_messages);
-    printk(KERN_INFO "ERANROI - Message added to receiver's message list\n");
 
-    printk(KERN_INFO "ERANROI - Checking if receiver has watched_pids\n");
-    int i;
-    if (p->watched_pids != NULL) {
-        for (i = 0; i < p->num_watched_pids; ++i) {
-            printk(KERN_INFO "ERANROI - Receiver watched_pids[%d] = %d\n", i, p->watched_pids[i]);
-            if (current->pid == p->watched_pids[i]) {
-                printk(KERN_INFO "ERANROI - Waking up receiver\n");
-                p->sender_pid = current->pid;
-                set_task_state(p, TASK_RUNNING);
-                wake_up_process(p);
+    for (i = 0; i < n; ++i) {
+        if (get_user(pid, &pids[i])) {
+            res = -EFAULT;
+            break;
+        }
+        res = mpi_get_receiver(pid, &mb);
+        if (res) {
+            break;
+        }
+        mn = mpi_alloc_shared_message(buffer, i * stride, message_size);
+        if (!mn) {
+            mpi_put_mailbox(mb);
+            res = -ENOMEM;
+            break;
+        }
+        mn->stamp = start;
+        res = mpi_enqueue(mb, mn);
+        mpi_put_mailbox(mb);
+        if (res) {
+            break;
+        }
+        sent++;
+    }
+    mpi_put_buffer(buffer);
+    return sent ? sent : res;
+}
+
+// Send the same message to each of the n pids in pids
+int sys_mpi_bcast(pid_t *pids, int n, char *message, ssize_t message_size) {
+    return mpi_send_collective(pids, n, message, message_size, 0);
+}
+
+// Send the i-th message_size bytes slice of buf to pids[i], for each of the
+// n pids in pids; buf holds n * message_size bytes
+int sys_mpi_scatter(pid_t *pids, int n, char *buf, ssize_t message_size) {
+    return mpi_send_collective(pids, n, buf, message_size, message_size);
+}
+
+// Receive a message from a specific sender process, sleeping until one
+// arrives. timeout is in milliseconds; 0 does not block, negative waits
+// forever. Returns -ETIMEDOUT on timeout and -EINTR if a signal arrives.
+int sys_mpi_receive_wait(pid_t sender_pid, char* user_buffer, ssize_t buffer_length, long timeout) {
+    DECLARE_WAITQUEUE(wait, current);
+    long remaining = mpi_timeout_to_jiffies(timeout);
+    int res;
+
+    res = sys_mpi_receive(sender_pid, user_buffer, buffer_length);
+    if (res != -EAGAIN || timeout == 0) {
+        return res;
+    }
+    if (mpi_reserve_watched_pids(1)) {
+        return -ENOMEM;
+    }
+
+    // Watch just this sender while we sleep
+    add_wait_queue(&current->mpi_wait, &wait);
+    current->watched_pids[0] = sender_pid;
+    mpi_set_watched(1);
+    for (;;) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (mpi_message_pending(current->mpi_mailbox, sender_pid)) {
+            // A thread sharing our mailbox may take the message first; if
+            // so, wait for the next one with whatever time is left
+            set_current_state(TASK_RUNNING);
+            res = sys_mpi_receive(sender_pid, user_buffer, buffer_length);
+            if (res != -EAGAIN) {
+                break;
             }
+            continue;
+        }
+        if (!remaining) {
+            res = -ETIMEDOUT;
+            break;
         }
+        if (signal_pending(current)) {
+            res = -EINTR;
+            break;
+        }
+        remaining = schedule_timeout(remaining);
     }
+    set_current_state(TASK_RUNNING);
+    mpi_set_watched(0);
+    remove_wait_queue(&current->mpi_wait, &wait);
+    return res;
+}
+
+// Send one message per entry of iov in a single system call. The result of
+// every send is stored in its entry's status field; returns the number of
+// messages that were sent.
+int sys_mpi_sendv(struct mpi_iovec *iov, int n) {
+    struct mpi_iovec entry;
+    int sent = 0;
+    int i;
+
+    if (n < 1 || n > MPI_IOV_MAX) {
+        return -EINVAL;
+    }
+    for (i = 0; i < n; ++i) {
+        if (copy_from_user(&entry, &iov[i], sizeof(entry))) {
+            return sent ? sent : -EFAULT;
+        }
+        entry.status = sys_mpi_send(entry.pid, entry.buf, entry.len);
+        if (put_user(entry.status, &iov[i].status)) {
+            return sent ? sent : -EFAULT;
+        }
+        if (entry.status == 0) {
+            sent++;
+        }
+    }
+    return sent;
+}
+
+// Receive up to one message per entry of iov in a single system call, from
+// the sender named by the entry. A sender may appear in several entries to
+// drain several of its messages. The received length, or -EAGAIN if nothing
+// was queued, is stored in each entry's status field; returns the number of
+// messages that were received.
+int sys_mpi_recvv(struct mpi_iovec *iov, int n) {
+    struct mpi_iovec entry;
+    int received = 0;
+    int i;
 
+    if (n < 1 || n > MPI_IOV_MAX) {
+        return -EINVAL;
+    }
+    if (current->mpi_registered == 0) {
+        return -EPERM;
+    }
+    for (i = 0; i < n; ++i) {
+        if (copy_from_user(&entry, &iov[i], sizeof(entry))) {
+            return received ? received : -EFAULT;
+        }
+        entry.status = sys_mpi_receive(entry.pid, entry.buf, entry.len);
+        if (put_user(entry.status, &iov[i].status)) {
+            return received ? received : -EFAULT;
+        }
+        if (entry.status >= 0) {
+            received++;
+        }
+    }
+    return received;
+}
+
+// Get and/or set the limits on messages queued in the current task's mailbox
+// and whether its own sends to a full receiver block (MPI_QUOTA_BLOCK) or
+// fail with -EAGAIN. The current settings and occupancy are stored in oquota
+// if it is not NULL, then the limits in quota are applied if it is not NULL.
+// A limit of 0 means unlimited; queued_msgs and queued_bytes of quota are
+// ignored. The limits are shared by all users of a MPI_REGISTER_TGID
+// mailbox, the flags are per task.
+int sys_mpi_quota(const struct mpi_quota *quota, struct mpi_quota *oquota) {
+    struct mpi_mailbox *mb = current->mpi_mailbox;
+    struct mpi_quota q;
+
+    if (current->mpi_registered == 0) {
+        return -EPERM;
+    }
+    if (oquota) {
+        spin_lock(&mb->lock);
+        q.max_msgs = mb->max_msgs;
+        q.max_bytes = mb->max_bytes;
+        q.max_pair_msgs = mb->max_pair_msgs;
+        q.max_pair_bytes = mb->max_pair_bytes;
+        q.flags = current->mpi_quota_flags;
+        q.queued_msgs = mb->queued_msgs;
+        q.queued_bytes = mb->queued_bytes;
+        spin_unlock(&mb->lock);
+        if (copy_to_user(oquota, &q, sizeof(q))) {
+            return -EFAULT;
+        }
+    }
+    if (quota) {
+        if (copy_from_user(&q, quota, sizeof(q))) {
+            return -EFAULT;
+        }
+        if (q.max_msgs < 0 || q.max_bytes < 0 || q.max_pair_msgs < 0 ||
+            q.max_pair_bytes < 0 || (q.flags & ~MPI_QUOTA_BLOCK)) {
+            return -EINVAL;
+        }
+        spin_lock(&mb->lock);
+        mb->max_msgs = q.max_msgs;
+        mb->max_bytes = q.max_bytes;
+        mb->max_pair_msgs = q.max_pair_msgs;
+        mb->max_pair_bytes = q.max_pair_bytes;
+        spin_unlock(&mb->lock);
+        current->mpi_quota_flags = q.flags;
+        // The limits may have grown; let blocked senders recheck
+        wake_up(&mb->space_wait);
+    }
     return 0;
 }
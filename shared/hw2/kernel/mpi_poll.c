@@ -1,119 +1,460 @@
 #include <linux/kernel.h>
+#include <linux/init.h>
 #include <linux/sched.h>
+#include <linux/time.h>
 #include <asm/current.h>
 #include <linux/slab.h>
 #include <linux/mpi.h>
 #include <asm/uaccess.h>
 
+static kmem_cache_t *mpi_pollset_entry_cachep;
+
+static int __init mpi_poll_init(void)
+{
+    mpi_pollset_entry_cachep = kmem_cache_create("mpi_pollset_entry",
+                                                 sizeof(struct mpi_pollset_entry),
+                                                 0, SLAB_HWCACHE_ALIGN, NULL, NULL);
+    if (!mpi_pollset_entry_cachep)
+        panic("Cannot create mpi_pollset_entry SLAB cache");
+    return 0;
+}
+__initcall(mpi_poll_init);
+
+/*
+ * Fill in the incoming, count and bytes fields of every entry of poll_pids;
+ * returns how many entries are ready. The mailbox lock is only held for the
+ * lookup of each pid, never across the user copies.
+ */
+static int mpi_poll_scan(struct mpi_poll_entry *poll_pids, int npids)
+{
+    struct mpi_mailbox *mb = current->mpi_mailbox;
+    struct mpi_poll_entry entry;
+    struct pid_queue *pq;
+    int found = 0;
+    int i;
+
+    for (i = 0; i < npids; ++i) {
+        if (copy_from_user(&entry, &poll_pids[i], sizeof(entry)))
+            return -EFAULT;
+        spin_lock(&mb->lock);
+        pq = mpi_find_pid_queue(mb, entry.pid);
+        entry.count = pq ? pq->count : 0;
+        entry.bytes = pq ? pq->bytes : 0;
+        spin_unlock(&mb->lock);
+        entry.incoming = entry.count > 0;
+        if (entry.incoming) {
+            MPI_TRACE(KERN_INFO "ERANROI - Message found from pid = %d\n", entry.pid);
+            found++;
+        }
+        if (copy_to_user(&poll_pids[i], &entry, sizeof(entry)))
+            return -EFAULT;
+    }
+    return found;
+}
+
+/*
+ * Common body of sys_mpi_poll and sys_mpi_poll_timed. *timeout is in jiffies
+ * (MAX_SCHEDULE_TIMEOUT waits forever) and is updated with the time left.
+ */
+static int do_mpi_poll(struct mpi_poll_entry *poll_pids, int npids, long *timeout)
+{
+    if (current->mpi_registered == 0) {
+        MPI_TRACE(KERN_ERR "ERANROI - Current process not registered for MPI\n");
+        return -EPERM;
+    }
+
+    int fail_cp;
+    int found = 0;
+    int i;
+    DECLARE_WAITQUEUE(wait, current);
+
+    found = mpi_poll_scan(poll_pids, npids);
+    if (found != 0) {
+        MPI_TRACE(KERN_INFO "ERANROI - Found %d messages\n", found);
+        return found;
+    }
+
+    MPI_TRACE(KERN_INFO "ERANROI - No messages found, going to sleep\n");
+    MPI_TRACE(KERN_INFO "ERANROI - Reserving room for watched_pids\n");
+    if (mpi_reserve_watched_pids(npids)) {
+        MPI_TRACE(KERN_ERR "ERANROI - ENOMEM: Could not allocate memory for watched_pids\n");
+        return -ENOMEM;
+    }
+
+    MPI_TRACE(KERN_INFO "ERANROI - Copying pids from user space\n");
+    for (i = 0; i < npids; ++i) {
+        fail_cp = copy_from_user(&current->watched_pids[i], &poll_pids[i].pid, sizeof(pid_t));
+        MPI_TRACE(KERN_INFO "ERANROI - current->watched_pids[%d] = %d\n", i, current->watched_pids[i]);
+        if (fail_cp) {
+            MPI_TRACE(KERN_ERR "ERANROI - EFAULT: Failed to copy from user space\n");
+            return -EFAULT;
+        }
+    }
+    mpi_sort_pids(current->watched_pids, npids);
+
+    // Publish the watch set, then look again for messages that arrived
+    // while we were copying it in
+    current->sender_pid = 0;
+    add_wait_queue(&current->mpi_wait, &wait);
+    mpi_set_watched(npids);
+    MPI_TRACE(KERN_INFO "ERANROI - current->num_watched_pids = %d\n", npids);
+
+    int res = 0;
+    found = mpi_poll_scan(poll_pids, npids);
+    while (!found) {
+        MPI_TRACE(KERN_INFO "ERANROI - Setting current process state to TASK_INTERRUPTIBLE\n");
+        set_current_state(TASK_INTERRUPTIBLE);
+        // A sender may have marked us after the last scan; look before sleeping
+        if (current->sender_pid) {
+            MPI_TRACE(KERN_INFO "ERANROI - Woken up by message from sender_pid = %d\n", current->sender_pid);
+            set_current_state(TASK_RUNNING);
+            current->sender_pid = 0;
+            found = mpi_poll_scan(poll_pids, npids);
+            continue;
+        }
+        if (!*timeout) {
+            MPI_TRACE(KERN_ERR "ERANROI - ETIMEDOUT: No message arrived before timeout\n");
+            res = -ETIMEDOUT;
+            break;
+        }
+        if (signal_pending(current)) {
+            MPI_TRACE(KERN_ERR "ERANROI - EINTR: Interrupted by a signal\n");
+            res = -EINTR;
+            break;
+        }
+        MPI_TRACE(KERN_INFO "ERANROI - Going to schedule with timeout = %ld\n", *timeout);
+        *timeout = schedule_timeout(*timeout);
+        MPI_TRACE(KERN_INFO "ERANROI - schedule_timeout returned = %ld\n", *timeout);
+    }
+    set_current_state(TASK_RUNNING);
+
+    MPI_TRACE(KERN_INFO "ERANROI - Retiring watch set\n");
+    mpi_set_watched(0);
+    remove_wait_queue(&current->mpi_wait, &wait);
+
+    if (res)
+        return res;
+    if (found < 0)
+        return found;
+
+    MPI_TRACE(KERN_INFO "ERANROI - Found %d messages\n", found);
+    return found;
+}
+
 /**
  * sys_mpi_poll - Polls for messages from a list of pids within a given timeout period
  * @poll_pids: Pointer to an array of mpi_poll_entry structures containing the pids to poll
  * @npids: Number of pids in the poll_pids array
- * @timeout: Timeout value in jiffies for how long to wait for messages
+ * @timeout: Timeout value in seconds for how long to wait for messages
  *
  * This function checks for incoming messages from a list of process IDs (pids). If messages 
- * are found from any of the specified pids, it updates the incoming field of the corresponding 
- * mpi_poll_entry structure. If no messages are found, the current process is put to sleep 
- * until a message is received or the timeout expires. The function returns the number of 
- * messages found or a negative error code on failure.
+ * are found from any of the specified pids, it updates the incoming, count and bytes fields 
+ * of the corresponding mpi_poll_entry structures. If no messages are found, the pids are 
+ * installed as the current process' sorted watch set and it sleeps interruptibly on its 
+ * mpi wait queue until a watched sender delivers a message, the timeout expires or a 
+ * signal arrives, and then reports every ready pid. The watch set storage is reused by 
+ * later calls. See sys_mpi_poll_timed for sub-second timeouts.
  *
- * Return: Number of messages found on success, or a negative error code on failure.
- *         -EINVAL if npids is less than 1 or timeout is negative.
+ * Return: Number of ready pids on success, or a negative error code on failure.
+ *         -EINVAL if npids is less than 1 or more than MPI_POLL_MAX, or timeout is negative.
  *         -EPERM if the current process is not registered for MPI.
  *         -ENOMEM if memory allocation for watched_pids fails.
  *         -EFAULT if copying from user space fails.
  *         -ETIMEDOUT if no message arrives before the timeout.
+ *         -EINTR if a signal arrives while waiting.
  */
 int sys_mpi_poll(struct mpi_poll_entry *poll_pids, int npids, int timeout)
 {
-    printk(KERN_INFO "ERANROI - POLL: Entered sys_mpi_poll\n");
-    if (npids < 1 || timeout < 0) {
-        printk(KERN_ERR "ERANROI - Invalid arguments: npids = %d, timeout = %d\n", npids, timeout);
+    MPI_TRACE(KERN_INFO "ERANROI - POLL: Entered sys_mpi_poll\n");
+    if (npids < 1 || npids > MPI_POLL_MAX || timeout < 0) {
+        MPI_TRACE(KERN_ERR "ERANROI - Invalid arguments: npids = %d, timeout = %d\n", npids, timeout);
         return -EINVAL;
     }
-    if (current->mpi_registered == 0) {
-        printk(KERN_ERR "ERANROI - Current process not registered for MPI\n");
-        return -EPERM;
+
+    long remaining = timeout < MAX_SCHEDULE_TIMEOUT / HZ ? timeout * HZ : MAX_SCHEDULE_TIMEOUT;
+    return do_mpi_poll(poll_pids, npids, &remaining);
+}
+
+/**
+ * sys_mpi_poll_timed - sys_mpi_poll with a timespec timeout
+ * @poll_pids: Pointer to an array of mpi_poll_entry structures containing the pids to poll
+ * @npids: Number of pids in the poll_pids array
+ * @timeout: Time to wait for messages, or NULL to wait forever
+ *
+ * Behaves like sys_mpi_poll, but the timeout has jiffy rather than second
+ * granularity. On return, *timeout holds the time that was left, whether the
+ * call succeeded, timed out or was interrupted, so it can be restarted.
+ *
+ * Return: As for sys_mpi_poll; -EINVAL also if *timeout is not a valid timespec.
+ */
+int sys_mpi_poll_timed(struct mpi_poll_entry *poll_pids, int npids, struct timespec *timeout)
+{
+    struct timespec ts;
+    long remaining = MAX_SCHEDULE_TIMEOUT;
+    int res;
+
+    if (npids < 1 || npids > MPI_POLL_MAX)
+        return -EINVAL;
+    if (timeout) {
+        if (copy_from_user(&ts, timeout, sizeof(ts)))
+            return -EFAULT;
+        if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1000000000L)
+            return -EINVAL;
+        remaining = timespec_to_jiffies(&ts);
     }
 
-    int fail_cp;
-    struct pid_queue *cur_pid_queue;
-    pid_t cur_sender_pid;
-    list_t *head_messages;
-    int found = 0;
-    list_t *q_it; // current queue iterator
+    res = do_mpi_poll(poll_pids, npids, &remaining);
+
+    if (timeout) {
+        jiffies_to_timespec(remaining, &ts);
+        if (copy_to_user(timeout, &ts, sizeof(ts)))
+            return -EFAULT;
+    }
+    return res;
+}
+
+static inline list_t *mpi_pollset_bucket(struct mpi_pollset *ps, pid_t pid)
+{
+    return &ps->hash[(unsigned int)pid % MPI_POLLSET_HASH_SIZE];
+}
+
+static struct mpi_pollset_entry *mpi_pollset_find(struct mpi_pollset *ps, pid_t pid)
+{
+    struct mpi_pollset_entry *entry;
+    list_t *it;
+
+    list_for_each(it, mpi_pollset_bucket(ps, pid)) {
+        entry = list_entry(it, struct mpi_pollset_entry, l_hash);
+        if (entry->pid == pid)
+            return entry;
+    }
+    return NULL;
+}
+
+/* Returns 1 if p was waiting and has been woken */
+static int mpi_pollset_mark_ready(task_t *p, struct mpi_pollset_entry *entry)
+{
+    if (entry->ready)
+        return 0;
+    entry->ready = 1;
+    list_add_tail(&entry->l_ready, &p->mpi_pollset->ready);
+    if (!waitqueue_active(&p->mpi_wait))
+        return 0;
+    wake_up(&p->mpi_wait);
+    return 1;
+}
+
+/*
+ * Called by sys_mpi_send after queueing a message from sender_pid to p: if p
+ * watches sender_pid in its poll set, push the entry onto the ready list.
+ * Returns 1 if that woke p. Caller holds p's mailbox lock.
+ */
+int mpi_pollset_notify(task_t *p, pid_t sender_pid)
+{
+    struct mpi_pollset_entry *entry = mpi_pollset_find(p->mpi_pollset, sender_pid);
+
+    return entry ? mpi_pollset_mark_ready(p, entry) : 0;
+}
+
+/*
+ * Release the poll set of a task that is going away
+ */
+void mpi_free_pollset(task_t *p)
+{
+    struct mpi_pollset *ps = p->mpi_pollset;
+    list_t *it, *n;
     int i;
 
-    printk(KERN_INFO "ERANROI - Initializing incoming fields to 0\n");
-    for (i = 0; i < npids; ++i) {
-        poll_pids[i].incoming = 0;
+    if (!ps)
+        return;
+    for (i = 0; i < MPI_POLLSET_HASH_SIZE; ++i) {
+        list_for_each_safe(it, n, &ps->hash[i]) {
+            kmem_cache_free(mpi_pollset_entry_cachep,
+                            list_entry(it, struct mpi_pollset_entry, l_hash));
+        }
     }
+    kfree(ps);
+    p->mpi_pollset = NULL;
+}
 
-    printk(KERN_INFO "ERANROI - Iterating through current->l_queue_by_pid\n");
-    list_for_each(q_it, &current->l_queue_by_pid) {
-        cur_pid_queue = list_entry(q_it, struct pid_queue, l_idx);
-        cur_sender_pid = cur_pid_queue->sender_pid;
-        printk(KERN_INFO "ERANROI - Checking sender_pid = %d\n", cur_sender_pid);
-        for (i = 0; i < npids; ++i) {
-            if (cur_sender_pid == poll_pids[i].pid) {
-                found++;
-                poll_pids[i].incoming = 1;
-                printk(KERN_INFO "ERANROI - Message found from pid = %d\n", cur_sender_pid);
-            }
+/**
+ * sys_mpi_pollset_ctl - Add a pid to or remove it from the caller's poll set
+ * @op: MPI_POLLSET_ADD or MPI_POLLSET_DEL
+ * @pid: The sender pid to watch or stop watching
+ *
+ * The poll set is created on the first MPI_POLLSET_ADD and persists until the
+ * task exits. A pid that already has queued messages when it is added is
+ * reported by the next sys_mpi_pollset_wait.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ *         -EINVAL if op is unknown.
+ *         -EPERM if the current process is not registered for MPI.
+ *         -ENOMEM if the poll set or entry cannot be allocated.
+ *         -EEXIST if adding a pid that is already in the set.
+ *         -ENOENT if removing a pid that is not in the set.
+ */
+int sys_mpi_pollset_ctl(int op, pid_t pid)
+{
+    struct mpi_mailbox *mb = current->mpi_mailbox;
+    struct mpi_pollset *ps;
+    struct mpi_pollset_entry *entry;
+    struct pid_queue *pq;
+    int i;
+
+    if (op != MPI_POLLSET_ADD && op != MPI_POLLSET_DEL)
+        return -EINVAL;
+    if (current->mpi_registered == 0)
+        return -EPERM;
+
+    ps = current->mpi_pollset;
+    if (op == MPI_POLLSET_DEL) {
+        spin_lock(&mb->lock);
+        entry = ps ? mpi_pollset_find(ps, pid) : NULL;
+        if (entry) {
+            list_del(&entry->l_hash);
+            if (entry->ready)
+                list_del(&entry->l_ready);
         }
+        spin_unlock(&mb->lock);
+        if (!entry)
+            return -ENOENT;
+        kmem_cache_free(mpi_pollset_entry_cachep, entry);
+        return 0;
     }
 
-    if (found > 0) {
-        printk(KERN_INFO "ERANROI - Found %d messages\n", found);
-        return found;
+    if (!ps) {
+        ps = kmalloc(sizeof(struct mpi_pollset), GFP_KERNEL);
+        if (!ps)
+            return -ENOMEM;
+        for (i = 0; i < MPI_POLLSET_HASH_SIZE; ++i)
+            INIT_LIST_HEAD(&ps->hash[i]);
+        INIT_LIST_HEAD(&ps->ready);
+        spin_lock(&mb->lock);
+        current->mpi_pollset = ps;
+        spin_unlock(&mb->lock);
     }
 
-    printk(KERN_INFO "ERANROI - No messages found, going to sleep\n");
-    printk(KERN_INFO "ERANROI - Allocating memory for watched_pids\n");
-    current->watched_pids = kmalloc(sizeof(pid_t) * npids, GFP_KERNEL);
-    if (!current->watched_pids) {
-        printk(KERN_ERR "ERANROI - ENOMEM: Could not allocate memory for watched_pids\n");
+    /* Allocate first; the entry is dropped again if pid is already in the set */
+    entry = kmem_cache_alloc(mpi_pollset_entry_cachep, GFP_KERNEL);
+    if (!entry)
         return -ENOMEM;
-    }
+    entry->pid = pid;
+    entry->ready = 0;
 
-    printk(KERN_INFO "ERANROI - Copying pids from user space\n");
-    for (i = 0; i < npids; ++i) {
-        fail_cp = copy_from_user(&current->watched_pids[i], &poll_pids[i].pid, sizeof(pid_t));
-        printk(KERN_INFO "ERANROI - current->watched_pids[%d] = %d\n", i, current->watched_pids[i]);
-        if (fail_cp) {
-            printk(KERN_ERR "ERANROI - EFAULT: Failed to copy from user space\n");
-            kfree(current->watched_pids);
-            return -EFAULT;
-        }
+    spin_lock(&mb->lock);
+    if (mpi_pollset_find(ps, pid)) {
+        spin_unlock(&mb->lock);
+        kmem_cache_free(mpi_pollset_entry_cachep, entry);
+        return -EEXIST;
     }
+    list_add(&entry->l_hash, mpi_pollset_bucket(ps, pid));
+    pq = mpi_find_pid_queue(mb, pid);
+    if (pq && pq->count > 0)
+        mpi_pollset_mark_ready(current, entry);
+    spin_unlock(&mb->lock);
+    return 0;
+}
 
-    current->num_watched_pids = npids;
-    printk(KERN_INFO "ERANROI - current->num_watched_pids = %d\n", current->num_watched_pids);
-    printk(KERN_INFO "ERANROI - Setting current process state to TASK_UNINTERRUPTIBLE\n");
-    set_current_state(TASK_UNINTERRUPTIBLE);
-
-    printk(KERN_INFO "ERANROI - Going to schedule with timeout = %d\n", timeout);
-    int sch_time = schedule_timeout(timeout * HZ);
-    printk(KERN_INFO "ERANROI - schedule_timeout returned = %d\n", sch_time);
+/**
+ * sys_mpi_pollset_wait - Wait for senders in the caller's poll set to become ready
+ * @events: User array that receives one mpi_poll_entry per ready pid
+ * @maxevents: Length of the events array
+ * @timeout: Timeout in milliseconds; 0 does not block, negative waits forever
+ *
+ * Readiness is edge-triggered: a pid is reported once after one or more new
+ * messages from it are queued, and is reported again only after another
+ * message arrives. A pid whose messages were all received in the meantime,
+ * for instance by a thread sharing the mailbox, is not reported. The work
+ * done is proportional to the number of ready pids, not to the size of the set.
+ *
+ * Return: Number of events stored on success, or a negative error code on failure.
+ *         -EINVAL if maxevents is less than 1.
+ *         -EPERM if the current process is not registered for MPI.
+ *         -ENOENT if the caller never added a pid to its poll set.
+ *         -EFAULT if copying to user space fails.
+ *         -ETIMEDOUT if no pid becomes ready before the timeout.
+ *         -EINTR if a signal arrives while waiting.
+ */
+int sys_mpi_pollset_wait(struct mpi_poll_entry *events, int maxevents, long timeout)
+{
+    DECLARE_WAITQUEUE(wait, current);
+    long remaining = mpi_timeout_to_jiffies(timeout);
+    struct mpi_mailbox *mb = current->mpi_mailbox;
+    struct mpi_pollset *ps = current->mpi_pollset;
+    struct mpi_pollset_entry *entry;
+    struct mpi_poll_entry event;
+    struct pid_queue *pq;
+    int res = 0;
+    int n = 0;
 
-    printk(KERN_INFO "ERANROI - Freeing watched_pids\n");
-    kfree(current->watched_pids);
-    current->watched_pids = NULL;
+    if (maxevents < 1)
+        return -EINVAL;
+    if (current->mpi_registered == 0)
+        return -EPERM;
+    if (!ps)
+        return -ENOENT;
 
-    if (!sch_time) {
-        printk(KERN_ERR "ERANROI - ETIMEDOUT: No message arrived before timeout\n");
-        return -ETIMEDOUT;
-    }
+    for (;;) {
+        /* list_empty() on the ready list is a racy peek; senders add under the lock */
+        if (list_empty(&ps->ready)) {
+            if (timeout == 0)
+                return 0;
+            add_wait_queue(&current->mpi_wait, &wait);
+            for (;;) {
+                set_current_state(TASK_INTERRUPTIBLE);
+                if (!list_empty(&ps->ready))
+                    break;
+                if (!remaining) {
+                    res = -ETIMEDOUT;
+                    break;
+                }
+                if (signal_pending(current)) {
+                    res = -EINTR;
+                    break;
+                }
+                remaining = schedule_timeout(remaining);
+            }
+            set_current_state(TASK_RUNNING);
+            remove_wait_queue(&current->mpi_wait, &wait);
+            if (res)
+                return res;
+        }
 
-    printk(KERN_INFO "ERANROI - Woken up by message from sender_pid = %d\n", current->sender_pid);
-    for (i = 0; i < npids; ++i) {
-        if (current->sender_pid == poll_pids[i].pid) {
-            poll_pids[i].incoming = 1;
-            printk(KERN_INFO "ERANROI - Incoming message from pid = %d\n", current->sender_pid);
-            return 1;
+        while (n < maxevents) {
+            spin_lock(&mb->lock);
+            if (list_empty(&ps->ready)) {
+                spin_unlock(&mb->lock);
+                break;
+            }
+            entry = list_entry(ps->ready.next, struct mpi_pollset_entry, l_ready);
+            list_del(&entry->l_ready);
+            entry->ready = 0;
+            pq = mpi_find_pid_queue(mb, entry->pid);
+            if (!pq || !pq->count) {
+                /* A thread sharing the mailbox drained it meanwhile */
+                spin_unlock(&mb->lock);
+                continue;
+            }
+            event.pid = entry->pid;
+            event.incoming = 1;
+            event.count = pq->count;
+            event.bytes = pq->bytes;
+            spin_unlock(&mb->lock);
+            if (copy_to_user(&events[n], &event, sizeof(event))) {
+                /* Report it again next time; the entry may have been removed meanwhile */
+                spin_lock(&mb->lock);
+                entry = mpi_pollset_find(ps, event.pid);
+                if (entry && !entry->ready) {
+                    entry->ready = 1;
+                    list_add(&entry->l_ready, &ps->ready);
+                }
+                spin_unlock(&mb->lock);
+                return n ? n : -EFAULT;
+            }
+            n++;
         }
+        /* Every ready pid was drained; wait for the next one unless polling */
+        if (n || timeout == 0)
+            return n;
     }
-
-    printk(KERN_WARNING "ERANROI - Should not reach here\n");
-    return found;
 }
@@ -0,0 +1,197 @@
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/sched.h>
+#include <linux/proc_fs.h>
+#include <linux/string.h>
+#include <linux/seq_file.h>
+#include <linux/mpi.h>
+
+/*
+ * /proc/mpi: statistics of the MPI syscalls and the state of the mailboxes
+ */
+
+static struct proc_dir_entry *proc_mpi;
+
+/*
+ * /proc/mpi/stats: the per-CPU event counters summed over all CPUs. The
+ * sums are not a snapshot; counters keep moving while they are read.
+ */
+static int mpi_stats_read(char *page, char **start, off_t off, int count,
+                          int *eof, void *data)
+{
+    struct mpi_stats sum;
+    int cpu;
+    int len;
+
+    memset(&sum, 0, sizeof(sum));
+    for (cpu = 0; cpu < NR_CPUS; ++cpu) {
+        sum.sends += mpi_stats[cpu].sends;
+        sum.receives += mpi_stats[cpu].receives;
+        sum.eagain += mpi_stats[cpu].eagain;
+        sum.wakeups += mpi_stats[cpu].wakeups;
+        sum.bytes_sent += mpi_stats[cpu].bytes_sent;
+        sum.bytes_received += mpi_stats[cpu].bytes_received;
+    }
+
+    len = sprintf(page,
+                  "sends %lu\n"
+                  "receives %lu\n"
+                  "eagain %lu\n"
+                  "wakeups %lu\n"
+                  "bytes_sent %lu\n"
+                  "bytes_received %lu\n",
+                  sum.sends, sum.receives, sum.eagain, sum.wakeups,
+                  sum.bytes_sent, sum.bytes_received);
+
+    if (len <= off + count)
+        *eof = 1;
+    *start = page + off;
+    len -= off;
+    if (len > count)
+        len = count;
+    if (len < 0)
+        len = 0;
+    return len;
+}
+
+/*
+ * /proc/mpi/latency: histograms of the time spent in sys_mpi_send and of
+ * the time from send to delivery, in power of two microsecond buckets
+ */
+static int mpi_latency_read(char *page, char **start, off_t off, int count,
+                            int *eof, void *data)
+{
+    unsigned long send, queue;
+    int b, cpu;
+    int len;
+
+    len = sprintf(page, "%10s %12s %12s\n", "usecs <", "send", "queue");
+    for (b = 0; b < MPI_LAT_BUCKETS; ++b) {
+        send = 0;
+        queue = 0;
+        for (cpu = 0; cpu < NR_CPUS; ++cpu) {
+            send += mpi_stats[cpu].send_latency[b];
+            queue += mpi_stats[cpu].queue_latency[b];
+        }
+        if (b < MPI_LAT_BUCKETS - 1)
+            len += sprintf(page + len, "%10lu %12lu %12lu\n", 1UL << b, send, queue);
+        else
+            len += sprintf(page + len, "%10s %12lu %12lu\n", "inf", send, queue);
+    }
+
+    if (len <= off + count)
+        *eof = 1;
+    *start = page + off;
+    len -= off;
+    if (len > count)
+        len = count;
+    if (len < 0)
+        len = 0;
+    return len;
+}
+
+/*
+ * /proc/mpi/tasks: every registered task with the occupancy and quota of
+ * its mailbox, followed by one line per sender with queued messages. The
+ * queues of a mailbox shared by a thread group are listed under the first
+ * of its tasks only. Walks the task list like slabinfo walks the caches:
+ * position 0 is the header, position n the n-th task after init_task.
+ */
+static void *mpi_tasks_start(struct seq_file *m, loff_t *pos)
+{
+    loff_t n = *pos;
+    task_t *p = &init_task;
+
+    read_lock(&tasklist_lock);
+    if (!n)
+        return (void *)1;
+    while (n--) {
+        p = p->next_task;
+        if (p == &init_task)
+            return NULL;
+    }
+    return p;
+}
+
+static void *mpi_tasks_next(struct seq_file *m, void *v, loff_t *pos)
+{
+    task_t *p = v == (void *)1 ? &init_task : v;
+
+    ++*pos;
+    p = p->next_task;
+    return p == &init_task ? NULL : p;
+}
+
+static void mpi_tasks_stop(struct seq_file *m, void *v)
+{
+    read_unlock(&tasklist_lock);
+}
+
+static int mpi_tasks_show(struct seq_file *m, void *v)
+{
+    task_t *p = v;
+    struct mpi_mailbox *mb;
+    struct pid_queue *pq;
+    list_t *it;
+
+    if (v == (void *)1) {
+        seq_printf(m, "# task pid tgid shared msgs bytes max_msgs max_bytes "
+                      "max_pair_msgs max_pair_bytes waiting\n"
+                      "#   sender pid msgs bytes\n");
+        return 0;
+    }
+    /* The mailbox cannot go away while we hold tasklist_lock */
+    mb = p->mpi_mailbox;
+    if (!mb)
+        return 0;
+
+    spin_lock(&mb->lock);
+    seq_printf(m, "task %d %d %d %d %ld %d %ld %d %ld %d\n",
+               p->pid, p->tgid, mb->shared, mb->queued_msgs, mb->queued_bytes,
+               mb->max_msgs, mb->max_bytes, mb->max_pair_msgs, mb->max_pair_bytes,
+               p->num_watched_pids);
+    if (list_entry(mb->tasks.next, task_t, l_mpi_mailbox) == p) {
+        list_for_each(it, &mb->l_queue_by_pid) {
+            pq = list_entry(it, struct pid_queue, l_idx);
+            seq_printf(m, "  sender %d %d %ld\n",
+                       pq->sender_pid, pq->count, (long)pq->bytes);
+        }
+    }
+    spin_unlock(&mb->lock);
+    return 0;
+}
+
+static struct seq_operations mpi_tasks_op = {
+    start:      mpi_tasks_start,
+    next:       mpi_tasks_next,
+    stop:       mpi_tasks_stop,
+    show:       mpi_tasks_show,
+};
+
+static int mpi_tasks_open(struct inode *inode, struct file *file)
+{
+    return seq_open(file, &mpi_tasks_op);
+}
+
+static struct file_operations mpi_tasks_fops = {
+    open:       mpi_tasks_open,
+    read:       seq_read,
+    llseek:     seq_lseek,
+    release:    seq_release,
+};
+
+static int __init mpi_proc_init(void)
+{
+    struct proc_dir_entry *entry;
+
+    proc_mpi = proc_mkdir("mpi", NULL);
+    if (!proc_mpi)
+        return -ENOMEM;
+    create_proc_read_entry("stats", 0, proc_mpi, mpi_stats_read, NULL);
+    create_proc_read_entry("latency", 0, proc_mpi, mpi_latency_read, NULL);
+    entry = create_proc_entry("tasks", 0, proc_mpi);
+    if (entry)
+        entry->proc_fops = &mpi_tasks_fops;
+    return 0;
+}
+__initcall(mpi_proc_init);
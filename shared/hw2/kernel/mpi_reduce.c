@@ -0,0 +1,245 @@
+#include <linux/kernel.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/mpi.h>
+#include <asm/uaccess.h>
+#include <asm/i387.h>
+
+/*
+ * Reduction towards a root. Every contribution is folded element-wise into
+ * an accumulator hanging off the root's mailbox as soon as it arrives, so
+ * the root receives one vector instead of one message per rank.
+ *
+ * A round ends when the root has collected the contributions it waits for.
+ * Contributions are not tagged with a round: a rank must not contribute to
+ * the next round before the root is done with the current one, which
+ * holds whenever the root broadcasts the result or a go-ahead.
+ */
+
+static int mpi_reduce_elem_size(int op)
+{
+    switch (op & MPI_TYPE_MASK) {
+    case MPI_INT32:
+        return 4;
+    case MPI_INT64:
+        return 8;
+    case MPI_FLOAT:
+        return sizeof(float);
+    }
+    return 0;
+}
+
+/*
+ * The folding loops are kept to a plain counted loop over typed arrays, so
+ * that a compiler able to vectorize them will. Caller holds the FPU for
+ * MPI_FLOAT, see mpi_reduce_fold().
+ */
+#define MPI_REDUCE_LOOP(type, expr)                                     \
+    do {                                                                \
+        type *a = (type *)acc;                                          \
+        const type *b = (const type *)in;                               \
+        int i;                                                          \
+        for (i = 0; i < count; ++i)                                     \
+            a[i] = (expr);                                              \
+    } while (0)
+
+#define MPI_REDUCE_OPS(type)                                            \
+    do {                                                                \
+        switch (op & MPI_OP_MASK) {                                     \
+        case MPI_SUM:                                                   \
+            MPI_REDUCE_LOOP(type, a[i] + b[i]);                         \
+            break;                                                      \
+        case MPI_MIN:                                                   \
+            MPI_REDUCE_LOOP(type, b[i] < a[i] ? b[i] : a[i]);           \
+            break;                                                      \
+        case MPI_MAX:                                                   \
+            MPI_REDUCE_LOOP(type, b[i] > a[i] ? b[i] : a[i]);           \
+            break;                                                      \
+        }                                                               \
+    } while (0)
+
+/*
+ * Fold the count elements at in into acc. Float arithmetic uses the FPU,
+ * which the kernel may only touch between kernel_fpu_begin() and
+ * kernel_fpu_end(); nothing in between may sleep. kernel_fpu_begin() saves
+ * the user's FPU state but leaves its control word loaded, so fninit puts
+ * back the default one: all exceptions masked, round to nearest. A NaN or
+ * an overflow then yields NaN or inf instead of raising #MF in the kernel.
+ */
+static void mpi_reduce_fold(int op, void *acc, const void *in, int count)
+{
+    switch (op & MPI_TYPE_MASK) {
+    case MPI_INT32:
+        MPI_REDUCE_OPS(s32);
+        break;
+    case MPI_INT64:
+        MPI_REDUCE_OPS(s64);
+        break;
+    case MPI_FLOAT:
+        kernel_fpu_begin();
+        __asm__ __volatile__("fninit");
+        MPI_REDUCE_OPS(float);
+        kernel_fpu_end();
+        break;
+    }
+}
+
+/*
+ * Fold the contribution in, count elements, into the reduction towards mb,
+ * starting one with spare if there is none. Returns -EINVAL if the round in
+ * progress uses another op or count. Sets *spare to NULL if it was used.
+ */
+static int mpi_reduce_contribute(struct mpi_mailbox *mb, int op, const void *in,
+                                 int count, struct mpi_reduce **spare)
+{
+    struct mpi_reduce *r;
+    int res = 0;
+
+    spin_lock(&mb->lock);
+    r = mb->reduce;
+    if (!r) {
+        r = *spare;
+        *spare = NULL;
+        r->op = op;
+        r->count = count;
+        r->contributions = 1;
+        memcpy(r->acc, in, count * mpi_reduce_elem_size(op));
+        mb->reduce = r;
+    } else if (r->op != op || r->count != count) {
+        res = -EINVAL;
+    } else {
+        mpi_reduce_fold(op, r->acc, in, count);
+        r->contributions++;
+    }
+    spin_unlock(&mb->lock);
+    if (!res)
+        wake_up(&mb->reduce_wait);
+    return res;
+}
+
+/*
+ * Take the reduction towards mb once it holds at least want contributions,
+ * or right away if want is 0. Returns NULL with *res set if a signal
+ * arrives or there is nothing to take. A signal abandons the round: the
+ * partial accumulator is dropped, so that its contributions do not leak
+ * into the next round.
+ */
+static struct mpi_reduce *mpi_reduce_take(struct mpi_mailbox *mb, int want, int *res)
+{
+    DECLARE_WAITQUEUE(wait, current);
+    struct mpi_reduce *r = NULL;
+
+    *res = 0;
+    add_wait_queue(&mb->reduce_wait, &wait);
+    for (;;) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        spin_lock(&mb->lock);
+        if (mb->reduce && mb->reduce->contributions >= want) {
+            r = mb->reduce;
+            mb->reduce = NULL;
+        }
+        spin_unlock(&mb->lock);
+        if (r || !want)
+            break;
+        if (signal_pending(current)) {
+            spin_lock(&mb->lock);
+            r = mb->reduce;
+            mb->reduce = NULL;
+            spin_unlock(&mb->lock);
+            kfree(r);
+            r = NULL;
+            *res = -EINTR;
+            break;
+        }
+        schedule();
+    }
+    set_current_state(TASK_RUNNING);
+    remove_wait_queue(&mb->reduce_wait, &wait);
+    return r;
+}
+
+/**
+ * sys_mpi_reduce - Reduce vectors of the ranks into one at the root
+ * @root: pid of the task receiving the result
+ * @op: MPI_SUM, MPI_MIN or MPI_MAX or'ed with MPI_INT32, MPI_INT64 or MPI_FLOAT
+ * @buf: this rank's count elements; the root's are replaced by the result
+ * @count: number of elements
+ * @nranks: at the root, the number of ranks including itself; ignored elsewhere
+ *
+ * Ranks other than the root fold their vector into the root's accumulator
+ * and return at once. The root sleeps until nranks - 1 contributions have
+ * been folded, adds its own and copies the result to @buf. All ranks of a
+ * round must pass the same @op and @count. A root interrupted by a signal
+ * abandons the round and discards the contributions folded so far.
+ *
+ * Returns 0, or -EINVAL, -EPERM, -ESRCH, -ENOMEM, -EFAULT or -EINTR.
+ */
+int sys_mpi_reduce(pid_t root, int op, void *buf, int count, int nranks)
+{
+    int elem_size = mpi_reduce_elem_size(op);
+    struct mpi_mailbox *mb;
+    struct mpi_reduce *r;
+    struct mpi_reduce *spare = NULL;
+    void *in;
+    int is_root = root == current->pid;
+    int res;
+
+    if (!elem_size || (op & MPI_OP_MASK) < MPI_SUM || (op & MPI_OP_MASK) > MPI_MAX ||
+        (op & ~(MPI_OP_MASK | MPI_TYPE_MASK)))
+        return -EINVAL;
+    if (count < 1 || count > MPI_REDUCE_MAX_BYTES / elem_size || !buf)
+        return -EINVAL;
+    if (is_root && nranks < 1)
+        return -EINVAL;
+    res = mpi_get_receiver(root, &mb);
+    if (res)
+        return res;
+
+    /* Stage the vector, and an accumulator in case we start the round */
+    res = -ENOMEM;
+    in = kmalloc(count * elem_size, GFP_KERNEL);
+    if (!in)
+        goto out;
+    if (!is_root || nranks == 1) {
+        spare = kmalloc(sizeof(struct mpi_reduce) + count * elem_size, GFP_KERNEL);
+        if (!spare)
+            goto out_free;
+    }
+    res = -EFAULT;
+    if (copy_from_user(in, buf, count * elem_size))
+        goto out_free;
+
+    if (!is_root) {
+        res = mpi_reduce_contribute(mb, op, in, count, &spare);
+        goto out_free;
+    }
+
+    /* The root folds its own vector last, once the others are in */
+    r = mpi_reduce_take(mb, nranks - 1, &res);
+    if (res)
+        goto out_free;
+    if (!r) {
+        /* We are the only rank */
+        r = spare;
+        spare = NULL;
+        r->op = op;
+        r->count = count;
+        r->contributions = 0;
+        memcpy(r->acc, in, count * elem_size);
+    } else if (r->op != op || r->count != count) {
+        res = -EINVAL;
+    } else {
+        mpi_reduce_fold(op, r->acc, in, count);
+    }
+    if (!res && copy_to_user(buf, r->acc, count * elem_size))
+        res = -EFAULT;
+    kfree(r);
+
+out_free:
+    kfree(spare);
+    kfree(in);
+out:
+    mpi_put_mailbox(mb);
+    return res;
+}
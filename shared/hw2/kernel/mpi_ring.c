@@ -0,0 +1,218 @@
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/sched.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/miscdevice.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/mpi.h>
+#include <asm/uaccess.h>
+
+/*
+ * Zero-copy transport for a registered pair of MPI processes. The owner
+ * creates a ring for one peer through /dev/mpi_ring, the peer attaches to
+ * it, and both map the same kernel pages. The first page holds a
+ * struct mpi_ring_header, the rest is the data area. Payloads are written
+ * once by the sender and read in place by the receiver; sys_mpi_send and
+ * sys_mpi_poll stay the control and wakeup path.
+ */
+
+struct mpi_ring {
+    atomic_t count;         /* open files referring to the ring */
+    pid_t owner;            /* process that created the ring */
+    pid_t peer;             /* process allowed to attach */
+    int attached;
+    int nr_pages;
+    struct page **pages;
+    list_t l_idx;           /* link in mpi_rings */
+};
+
+static LIST_HEAD(mpi_rings);
+static spinlock_t mpi_rings_lock = SPIN_LOCK_UNLOCKED;
+
+static void mpi_ring_put(struct mpi_ring *ring)
+{
+    int i;
+
+    if (!atomic_dec_and_test(&ring->count))
+        return;
+    spin_lock(&mpi_rings_lock);
+    list_del(&ring->l_idx);
+    spin_unlock(&mpi_rings_lock);
+    for (i = 0; i < ring->nr_pages; ++i)
+        __free_page(ring->pages[i]);
+    kfree(ring->pages);
+    kfree(ring);
+}
+
+static int mpi_ring_create(struct file *file, struct mpi_ring_req *ureq)
+{
+    struct mpi_ring_req req;
+    struct mpi_ring_header *header;
+    struct mpi_ring *ring;
+    task_t *p;
+    int registered;
+    int nr_pages;
+    int i;
+
+    if (copy_from_user(&req, ureq, sizeof(req)))
+        return -EFAULT;
+    if (req.size < 1 || req.size > MPI_RING_MAX_SIZE)
+        return -EINVAL;
+
+    read_lock(&tasklist_lock);
+    p = find_task_by_pid(req.peer);
+    registered = p && p->mpi_registered;
+    read_unlock(&tasklist_lock);
+    if (!registered)
+        return p ? -EPERM : -ESRCH;
+
+    /* One header page followed by the data area */
+    nr_pages = 1 + (req.size + PAGE_SIZE - 1) / PAGE_SIZE;
+    ring = kmalloc(sizeof(struct mpi_ring), GFP_KERNEL);
+    if (!ring)
+        return -ENOMEM;
+    ring->pages = kmalloc(sizeof(struct page *) * nr_pages, GFP_KERNEL);
+    if (!ring->pages) {
+        kfree(ring);
+        return -ENOMEM;
+    }
+    for (ring->nr_pages = 0; ring->nr_pages < nr_pages; ring->nr_pages++) {
+        ring->pages[ring->nr_pages] = alloc_page(GFP_HIGHUSER);
+        if (!ring->pages[ring->nr_pages])
+            goto out_free;
+        clear_highpage(ring->pages[ring->nr_pages]);
+    }
+
+    header = kmap(ring->pages[0]);
+    header->head = 0;
+    header->tail = 0;
+    header->size = (nr_pages - 1) * PAGE_SIZE;
+    kunmap(ring->pages[0]);
+
+    atomic_set(&ring->count, 1);
+    ring->owner = current->pid;
+    ring->peer = req.peer;
+    ring->attached = 0;
+
+    spin_lock(&mpi_rings_lock);
+    list_add(&ring->l_idx, &mpi_rings);
+    spin_unlock(&mpi_rings_lock);
+    file->private_data = ring;
+    return 0;
+
+out_free:
+    for (i = 0; i < ring->nr_pages; ++i)
+        __free_page(ring->pages[i]);
+    kfree(ring->pages);
+    kfree(ring);
+    return -ENOMEM;
+}
+
+static int mpi_ring_attach(struct file *file, pid_t owner)
+{
+    struct mpi_ring *ring;
+    list_t *it;
+    int res = -ENOENT;
+
+    spin_lock(&mpi_rings_lock);
+    list_for_each(it, &mpi_rings) {
+        ring = list_entry(it, struct mpi_ring, l_idx);
+        if (ring->owner == owner && ring->peer == current->pid && !ring->attached) {
+            ring->attached = 1;
+            atomic_inc(&ring->count);
+            file->private_data = ring;
+            res = 0;
+            break;
+        }
+    }
+    spin_unlock(&mpi_rings_lock);
+    return res;
+}
+
+static int mpi_ring_ioctl(struct inode *inode, struct file *file,
+                          unsigned int cmd, unsigned long arg)
+{
+    if (current->mpi_registered == 0)
+        return -EPERM;
+    if (file->private_data)
+        return -EBUSY;
+
+    switch (cmd) {
+    case MPI_RING_CREATE:
+        return mpi_ring_create(file, (struct mpi_ring_req *)arg);
+    case MPI_RING_ATTACH:
+        return mpi_ring_attach(file, (pid_t)arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
+static struct page *mpi_ring_nopage(struct vm_area_struct *vma,
+                                    unsigned long address, int unused)
+{
+    struct mpi_ring *ring = vma->vm_private_data;
+    unsigned long idx = (address - vma->vm_start) >> PAGE_SHIFT;
+    struct page *page;
+
+    if (idx >= ring->nr_pages)
+        return NOPAGE_SIGBUS;
+    page = ring->pages[idx];
+    get_page(page);
+    return page;
+}
+
+static struct vm_operations_struct mpi_ring_vm_ops = {
+    nopage:     mpi_ring_nopage,
+};
+
+static int mpi_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct mpi_ring *ring = file->private_data;
+
+    if (!ring)
+        return -EINVAL;
+    if (vma->vm_pgoff != 0 ||
+        vma->vm_end - vma->vm_start > (unsigned long)ring->nr_pages << PAGE_SHIFT)
+        return -EINVAL;
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+
+    /*
+     * The ring pages have no mapping, so swap_out would take a dirty one for
+     * anonymous memory and move it to the swap cache, after which the pte no
+     * longer points at ring->pages[] and the peers stop sharing it
+     */
+    vma->vm_flags |= VM_RESERVED;
+    vma->vm_ops = &mpi_ring_vm_ops;
+    vma->vm_private_data = ring;
+    return 0;
+}
+
+static int mpi_ring_release(struct inode *inode, struct file *file)
+{
+    if (file->private_data)
+        mpi_ring_put(file->private_data);
+    return 0;
+}
+
+static struct file_operations mpi_ring_fops = {
+    owner:      THIS_MODULE,
+    ioctl:      mpi_ring_ioctl,
+    mmap:       mpi_ring_mmap,
+    release:    mpi_ring_release,
+};
+
+static struct miscdevice mpi_ring_dev = {
+    MISC_DYNAMIC_MINOR,
+    "mpi_ring",
+    &mpi_ring_fops
+};
+
+static int __init mpi_ring_init(void)
+{
+    return misc_register(&mpi_ring_dev);
+}
+__initcall(mpi_ring_init);
@@ -0,0 +1,450 @@
+// Pass/fail checks of the MPI system calls, mostly of their error paths.
+// Build with: gcc -o main main.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "mpi_api.h"
+
+// A pid no task is expected to have
+#define NO_SUCH_PID 999999
+
+static int failures = 0;
+
+// Report one check and count it if it failed
+static void check(const char *what, int ok) {
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    if (!ok)
+        failures++;
+}
+
+// Whether a wrapper failed with the expected errno
+static int failed_with(int res, int err) {
+    return res == -1 && errno == err;
+}
+
+// Set our quota to the given limits
+static int set_quota(int max_msgs, long max_bytes, int flags) {
+    struct mpi_quota quota;
+
+    memset(&quota, 0, sizeof(quota));
+    quota.max_msgs = max_msgs;
+    quota.max_bytes = max_bytes;
+    quota.flags = flags;
+    return mpi_quota(&quota, NULL);
+}
+
+// Run fn in a child and return whether it returned non-zero there
+static int in_child(int (*fn)(void)) {
+    int status;
+    pid_t child = fork();
+
+    if (child == 0)
+        _exit(fn() ? 0 : 1);
+    waitpid(child, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int noinherit_grandchild(void) {
+    struct mpi_quota quota;
+
+    // We start unregistered, and registering does not bring back the
+    // parent's MPI_QUOTA_BLOCK
+    return failed_with(mpi_probe(getppid()), EPERM) && mpi_register() == 0 &&
+           mpi_quota(NULL, &quota) == 0 && quota.flags == 0;
+}
+
+static int noinherit_child(void) {
+    return mpi_register_ex(MPI_REGISTER_NOINHERIT) == 0 && set_quota(0, 0, MPI_QUOTA_BLOCK) == 0 &&
+           failed_with(mpi_register_ex(0), EBUSY) && in_child(noinherit_grandchild);
+}
+
+static int inherit_grandchild(void) {
+    struct mpi_quota quota;
+
+    // We start with an empty mailbox of our own and the parent's quota
+    return failed_with(mpi_probe(getppid()), EAGAIN) && mpi_quota(NULL, &quota) == 0 &&
+           quota.flags == MPI_QUOTA_BLOCK && quota.queued_msgs == 0;
+}
+
+static int inherit_child(void) {
+    return mpi_register() == 0 && set_quota(0, 0, MPI_QUOTA_BLOCK) == 0 && in_child(inherit_grandchild);
+}
+
+// What the children of a registered process inherit, by registration mode
+static void test_inherit(void) {
+    check("children of an MPI_REGISTER_NOINHERIT process start unregistered", in_child(noinherit_child));
+    check("children of a registered process start registered with its quota", in_child(inherit_child));
+}
+
+static void test_receive_wait(void) {
+    pid_t self = getpid();
+    char buffer[100];
+    int status;
+    pid_t child;
+
+    check("mpi_receive of an empty queue fails with EAGAIN",
+          failed_with(mpi_receive(self, buffer, sizeof(buffer)), EAGAIN));
+    check("mpi_receive_wait with timeout 0 fails with EAGAIN",
+          failed_with(mpi_receive_wait(self, buffer, sizeof(buffer), 0), EAGAIN));
+    check("mpi_receive_wait times out with ETIMEDOUT",
+          failed_with(mpi_receive_wait(self, buffer, sizeof(buffer), 20), ETIMEDOUT));
+    mpi_send(self, "hello", 6);
+    check("mpi_receive_wait returns a queued message at once",
+          mpi_receive_wait(self, buffer, sizeof(buffer), -1) == 6 && !strcmp(buffer, "hello"));
+
+    child = fork();
+    if (child == 0) {
+        usleep(50000);
+        _exit(mpi_send(self, "late", 5) ? 1 : 0);
+    }
+    check("mpi_receive_wait wakes up for a message sent while it sleeps",
+          mpi_receive_wait(child, buffer, sizeof(buffer), 1000) == 5 && !strcmp(buffer, "late"));
+    waitpid(child, &status, 0);
+}
+
+static void test_quota(void) {
+    pid_t self = getpid();
+    struct mpi_quota quota;
+    char buffer[100];
+    int status;
+    pid_t child;
+
+    check("mpi_quota rejects a negative limit", failed_with(set_quota(-1, 0, 0), EINVAL));
+    check("mpi_quota rejects an unknown flag", failed_with(set_quota(0, 0, 2), EINVAL));
+    check("mpi_quota sets a message limit", set_quota(1, 0, 0) == 0);
+    check("a send within the message limit succeeds", mpi_send(self, "a", 2) == 0);
+    check("a send over the message limit fails with EAGAIN", failed_with(mpi_send(self, "b", 2), EAGAIN));
+    check("mpi_quota reports the occupancy",
+          mpi_quota(NULL, &quota) == 0 && quota.queued_msgs == 1 && quota.queued_bytes == 2);
+    mpi_receive(self, buffer, sizeof(buffer));
+    check("mpi_quota sets a byte limit", set_quota(0, 4, 0) == 0);
+    check("a message over the byte limit fails with EMSGSIZE", failed_with(mpi_send(self, "hello", 6), EMSGSIZE));
+
+    // A blocking sender sleeps on our full mailbox until we receive
+    set_quota(1, 0, 0);
+    child = fork();
+    if (child == 0) {
+        if (set_quota(0, 0, MPI_QUOTA_BLOCK) || mpi_send(self, "a", 2) || mpi_send(self, "b", 2))
+            _exit(1);
+        _exit(0);
+    }
+    check("the first message of a blocking sender arrives",
+          mpi_receive_wait(child, buffer, sizeof(buffer), 1000) == 2 && buffer[0] == 'a');
+    check("the blocked sender is let through after a receive",
+          mpi_receive_wait(child, buffer, sizeof(buffer), 1000) == 2 && buffer[0] == 'b');
+    waitpid(child, &status, 0);
+    check("no send of the blocking sender failed", WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    set_quota(0, 0, 0);
+}
+
+static void test_probe(void) {
+    pid_t self = getpid();
+    char buffer[100];
+
+    check("mpi_probe of an empty queue fails with EAGAIN", failed_with(mpi_probe(self), EAGAIN));
+    mpi_send(self, "hello", 6);
+    mpi_send(self, "hi", 3);
+    check("mpi_probe returns the size of the oldest message", mpi_probe(self) == 6);
+    check("mpi_probe does not dequeue", mpi_probe(self) == 6);
+    check("mpi_receive returns the oldest message",
+          mpi_receive(self, buffer, sizeof(buffer)) == 6 && !strcmp(buffer, "hello"));
+    check("mpi_probe moves on to the next message", mpi_probe(self) == 3);
+    mpi_receive(self, buffer, sizeof(buffer));
+}
+
+static void test_receive_any(void) {
+    pid_t self = getpid();
+    pid_t senders[2];
+    pid_t from;
+    char buffer[100];
+    int next[2] = { 1, 1 };
+    int alternate = 1, in_order = 1, sent = 1;
+    int i, k, status;
+
+    check("mpi_receive_any with nothing queued fails with EAGAIN",
+          failed_with(mpi_receive_any(&from, buffer, sizeof(buffer)), EAGAIN));
+
+    // Sender a queues all of a1..a3 before sender b queues b1..b3
+    for (i = 0; i < 2; ++i) {
+        senders[i] = fork();
+        if (senders[i] == 0) {
+            char message[3];
+
+            message[0] = 'a' + i;
+            message[2] = 0;
+            for (k = 1; k <= 3; ++k) {
+                message[1] = '0' + k;
+                if (mpi_send(self, message, 3))
+                    _exit(1);
+            }
+            _exit(0);
+        }
+        waitpid(senders[i], &status, 0);
+        sent = sent && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    check("both senders queued their messages", sent);
+
+    for (i = 0; i < 6; ++i) {
+        if (mpi_receive_any(&from, buffer, sizeof(buffer)) != 3) {
+            in_order = 0;
+            break;
+        }
+        k = from == senders[1];
+        if (from != senders[k] || k != i % 2)
+            alternate = 0;
+        if (buffer[0] != 'a' + k || buffer[1] != '0' + next[k]++)
+            in_order = 0;
+    }
+    check("mpi_receive_any takes the senders in turn", alternate);
+    check("mpi_receive_any keeps the order of each sender", in_order);
+    check("mpi_receive_any drains the mailbox", failed_with(mpi_receive_any(&from, buffer, sizeof(buffer)), EAGAIN));
+}
+
+static void test_poll(void) {
+    pid_t self = getpid();
+    struct mpi_poll_entry entry;
+    struct mpi_poll_entry event;
+    char buffer[100];
+
+    memset(&entry, 0, sizeof(entry));
+    entry.pid = self;
+    check("mpi_poll rejects an empty list", failed_with(mpi_poll(&entry, 0, 0), EINVAL));
+    check("mpi_poll with nothing queued times out", failed_with(mpi_poll(&entry, 1, 0), ETIMEDOUT));
+    mpi_send(self, "hello", 6);
+    mpi_send(self, "hi", 3);
+    check("mpi_poll reports the count and size of the queued messages",
+          mpi_poll(&entry, 1, 0) == 1 && entry.incoming && entry.count == 2 && entry.bytes == 9);
+    mpi_receive(self, buffer, sizeof(buffer));
+    mpi_receive(self, buffer, sizeof(buffer));
+
+    check("mpi_pollset_wait without a poll set fails with ENOENT",
+          failed_with(mpi_pollset_wait(&event, 1, 0), ENOENT));
+    check("mpi_pollset_ctl rejects an unknown op", failed_with(mpi_pollset_ctl(3, self), EINVAL));
+    check("mpi_pollset_ctl adds a pid", mpi_pollset_ctl(MPI_POLLSET_ADD, self) == 0);
+    check("adding a pid twice fails with EEXIST", failed_with(mpi_pollset_ctl(MPI_POLLSET_ADD, self), EEXIST));
+    mpi_send(self, "hello", 6);
+    check("a pid is ready once a message arrives",
+          mpi_pollset_wait(&event, 1, 0) == 1 && event.pid == self && event.count == 1);
+    check("readiness is reported once", mpi_pollset_wait(&event, 1, 0) == 0);
+    mpi_send(self, "hi", 3);
+    mpi_receive(self, buffer, sizeof(buffer));
+    mpi_receive(self, buffer, sizeof(buffer));
+    check("a pid drained before the wait is not reported", mpi_pollset_wait(&event, 1, 0) == 0);
+    check("mpi_pollset_wait times out with ETIMEDOUT", failed_with(mpi_pollset_wait(&event, 1, 20), ETIMEDOUT));
+    check("mpi_pollset_ctl removes a pid", mpi_pollset_ctl(MPI_POLLSET_DEL, self) == 0);
+    check("removing a pid twice fails with ENOENT", failed_with(mpi_pollset_ctl(MPI_POLLSET_DEL, self), ENOENT));
+}
+
+static void on_alarm(int sig) {
+    (void)sig;
+}
+
+static void test_poll_timed(void) {
+    struct mpi_poll_entry entry;
+    struct timespec timeout;
+    struct sigaction action;
+    struct itimerval timer;
+    long long left;
+    int res;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.pid = getpid();
+    timeout.tv_sec = 0;
+    timeout.tv_nsec = 1000000000L;
+    check("mpi_poll_timed rejects a bad tv_nsec", failed_with(mpi_poll_timed(&entry, 1, &timeout), EINVAL));
+    timeout.tv_nsec = 20000000L;
+    check("mpi_poll_timed times out with no time left",
+          failed_with(mpi_poll_timed(&entry, 1, &timeout), ETIMEDOUT) && !timeout.tv_sec && !timeout.tv_nsec);
+
+    // Without SA_RESTART the alarm ends the wait with EINTR
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_alarm;
+    sigaction(SIGALRM, &action, NULL);
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_usec = 50000;
+    setitimer(ITIMER_REAL, &timer, NULL);
+    timeout.tv_sec = 2;
+    timeout.tv_nsec = 0;
+    res = mpi_poll_timed(&entry, 1, &timeout);
+    left = timeout.tv_sec * 1000000000LL + timeout.tv_nsec;
+    check("a signal interrupts mpi_poll_timed with EINTR", failed_with(res, EINTR));
+    check("mpi_poll_timed reports the time left after a signal", left > 0 && left < 2000000000LL);
+    signal(SIGALRM, SIG_DFL);
+}
+
+static void test_vectors(void) {
+    pid_t self = getpid();
+    struct mpi_iovec iov[2];
+    char first[100], second[100];
+
+    check("mpi_sendv rejects an empty vector", failed_with(mpi_sendv(iov, 0), EINVAL));
+    check("mpi_recvv rejects an empty vector", failed_with(mpi_recvv(iov, 0), EINVAL));
+
+    iov[0].pid = self;
+    iov[0].buf = "hello";
+    iov[0].len = 6;
+    iov[1].pid = NO_SUCH_PID;
+    iov[1].buf = "lost";
+    iov[1].len = 5;
+    check("mpi_sendv counts only the messages sent",
+          mpi_sendv(iov, 2) == 1 && iov[0].status == 0 && iov[1].status < 0);
+
+    iov[0].pid = self;
+    iov[0].buf = first;
+    iov[0].len = sizeof(first);
+    iov[1].pid = self;
+    iov[1].buf = second;
+    iov[1].len = sizeof(second);
+    check("mpi_recvv stores the length or error of every entry",
+          mpi_recvv(iov, 2) == 1 && iov[0].status == 6 && !strcmp(first, "hello") && iov[1].status == -EAGAIN);
+}
+
+static void test_ring(void) {
+    pid_t self = getpid();
+    long page_size = sysconf(_SC_PAGESIZE);
+    struct mpi_ring_header *ring;
+    char buffer[100];
+    int status;
+    pid_t child;
+
+    check("attaching without a ring fails with ENOENT", mpi_ring_map(NO_SUCH_PID, 0, 0) == NULL && errno == ENOENT);
+
+    child = fork();
+    if (child == 0) {
+        // Attach once the parent has created the ring and written to it
+        if (mpi_receive_wait(self, buffer, sizeof(buffer), 1000) != 3)
+            _exit(1);
+        ring = mpi_ring_map(self, 0, 0);
+        if (!ring || ring->head != 5 || strcmp((char *)ring + page_size, "ring"))
+            _exit(1);
+        ring->tail = ring->head;
+        _exit(0);
+    }
+    ring = mpi_ring_map(child, 4096, 1);
+    check("mpi_ring_map creates a ring for a registered child", ring != NULL && ring->size >= 4096);
+    if (ring) {
+        strcpy((char *)ring + page_size, "ring");
+        ring->head = 5;
+    }
+    mpi_send(child, "go", 3);
+    waitpid(child, &status, 0);
+    check("the peer attaches and reads the payload in place", WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    check("the owner sees the tail the peer advanced", ring && ring->tail == 5);
+    if (ring)
+        munmap(ring, page_size + ring->size);
+}
+
+static void test_register_ex(void) {
+    check("mpi_register_ex rejects an unknown flag", failed_with(mpi_register_ex(8), EINVAL));
+    check("registering again in the same mode is a no-op", mpi_register_ex(0) == 0);
+    check("registering again under the TGID fails with EBUSY",
+          failed_with(mpi_register_ex(MPI_REGISTER_TGID), EBUSY));
+}
+
+static void test_collectives(void) {
+    pid_t self = getpid();
+    pid_t pids[2] = { self, self };
+    pid_t bad[2] = { self, NO_SUCH_PID };
+    char buffer[100];
+
+    check("mpi_bcast rejects an empty pid list", failed_with(mpi_bcast(pids, 0, "x", 2), EINVAL));
+    check("mpi_bcast sends to every pid", mpi_bcast(pids, 2, "hello", 6) == 2);
+    check("every copy of a broadcast arrives",
+          mpi_receive(self, buffer, sizeof(buffer)) == 6 && !strcmp(buffer, "hello") &&
+          mpi_receive(self, buffer, sizeof(buffer)) == 6 && !strcmp(buffer, "hello"));
+    check("mpi_bcast stops at an unknown pid", mpi_bcast(bad, 2, "x", 2) == 1);
+    mpi_receive(self, buffer, sizeof(buffer));
+    check("mpi_bcast to only an unknown pid fails", mpi_bcast(bad + 1, 1, "x", 2) == -1);
+
+    check("mpi_scatter sends one slice per pid", mpi_scatter(pids, 2, "ab\0cd", 3) == 2);
+    check("the slices arrive in order",
+          mpi_receive(self, buffer, sizeof(buffer)) == 3 && !strcmp(buffer, "ab") &&
+          mpi_receive(self, buffer, sizeof(buffer)) == 3 && !strcmp(buffer, "cd"));
+}
+
+static void test_reduce(void) {
+    pid_t self = getpid();
+    int vec[4] = { 1, 2, 3, 4 };
+    int status;
+    pid_t child;
+
+    check("mpi_reduce rejects an unknown op", failed_with(mpi_reduce(self, 7 | MPI_INT32, vec, 4, 1), EINVAL));
+    check("mpi_reduce rejects an unknown type", failed_with(mpi_reduce(self, MPI_SUM | 0x40, vec, 4, 1), EINVAL));
+    check("mpi_reduce rejects an empty vector", failed_with(mpi_reduce(self, MPI_SUM | MPI_INT32, vec, 0, 1), EINVAL));
+    check("mpi_reduce at the root rejects nranks 0", failed_with(mpi_reduce(self, MPI_SUM | MPI_INT32, vec, 4, 0), EINVAL));
+    check("a reduction over the root alone returns its vector",
+          mpi_reduce(self, MPI_SUM | MPI_INT32, vec, 4, 1) == 0 && vec[0] == 1 && vec[3] == 4);
+
+    // Children of a registered process start registered
+    child = fork();
+    if (child == 0) {
+        int ones[4] = { 10, 10, 10, 10 };
+        _exit(mpi_reduce(self, MPI_SUM | MPI_INT32, ones, 4, 0) ? 1 : 0);
+    }
+    check("a reduction over two ranks sums their vectors",
+          mpi_reduce(self, MPI_SUM | MPI_INT32, vec, 4, 2) == 0 && vec[0] == 11 && vec[3] == 14);
+    waitpid(child, &status, 0);
+    check("the contributing rank succeeded", WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static void test_tags(void) {
+    pid_t self = getpid();
+    pid_t from;
+    char buffer[100];
+    int tag;
+
+    check("mpi_send_tag rejects a negative tag", failed_with(mpi_send_tag(self, -2, "x", 2), EINVAL));
+    mpi_send_tag(self, 1, "one", 4);
+    mpi_send_tag(self, 2, "two", 4);
+    mpi_send_tag(self, 1, "uno", 4);
+
+    from = self;
+    tag = 2;
+    check("mpi_receive_tag skips messages of other tags",
+          mpi_receive_tag(&from, &tag, buffer, sizeof(buffer)) == 4 && !strcmp(buffer, "two"));
+    from = MPI_ANY_SOURCE;
+    tag = MPI_ANY_TAG;
+    check("wildcards match the oldest message and report its sender and tag",
+          mpi_receive_tag(&from, &tag, buffer, sizeof(buffer)) == 4 && !strcmp(buffer, "one") &&
+          from == self && tag == 1);
+    from = self;
+    tag = 1;
+    check("messages of one tag arrive in order",
+          mpi_receive_tag(&from, &tag, buffer, sizeof(buffer)) == 4 && !strcmp(buffer, "uno"));
+    check("mpi_receive_tag with nothing queued fails with EAGAIN",
+          failed_with(mpi_receive_tag(&from, &tag, buffer, sizeof(buffer)), EAGAIN));
+    tag = -5;
+    check("mpi_receive_tag rejects a negative tag", failed_with(mpi_receive_tag(&from, &tag, buffer, sizeof(buffer)), EINVAL));
+    check("untagged messages carry tag 0", mpi_send(self, "zero", 5) == 0);
+    tag = 0;
+    check("and are received as such", mpi_receive_tag(&from, &tag, buffer, sizeof(buffer)) == 5);
+}
+
+int main() {
+    // Before we register, so that the children it forks start unregistered
+    test_inherit();
+
+    check("mpi_register succeeds", mpi_register() == 0);
+    test_register_ex();
+    test_receive_wait();
+    test_probe();
+    test_quota();
+    test_receive_any();
+    test_poll();
+    test_poll_timed();
+    test_vectors();
+    test_ring();
+    test_collectives();
+    test_reduce();
+    test_tags();
+
+    printf("%d checks failed\n", failures);
+    return failures != 0;
+}
@@ -2,13 +2,89 @@
 #define _MPI_API_H  
 
 #include <linux/errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 
-// Mpi poll struct, contains process' pid and indication of incoming message (246)
+// Mpi poll struct, contains process' pid, indication of incoming message and
+// the number and total size of the messages queued from it (246)
 struct mpi_poll_entry {
 	pid_t pid;
 	char incoming;
+	int count;
+	ssize_t bytes;
 };
 
+// Mpi iovec struct, one message of mpi_sendv / mpi_recvv (251, 252); status
+// receives 0 or the received length, or a negative error code
+struct mpi_iovec {
+	pid_t pid;
+	char *buf;
+	ssize_t len;
+	int status;
+};
+
+// Shared ring between a registered pair of processes (/dev/mpi_ring). The
+// owner creates it for one peer and the peer attaches; both map the same
+// pages. The first page is a struct mpi_ring_header and the data area starts
+// one page in. The sender writes a payload at head and advances it, then
+// mpi_send()s a small notification; the receiver reads the payload in place
+// and advances tail. Payloads are never copied by the kernel.
+struct mpi_ring_req {
+	pid_t peer;
+	unsigned int size;
+};
+
+struct mpi_ring_header {
+	volatile unsigned int head;
+	volatile unsigned int tail;
+	unsigned int size;
+};
+
+#define MPI_RING_CREATE _IOW('M', 1, struct mpi_ring_req)
+#define MPI_RING_ATTACH _IO('M', 2)     // the peer pid is passed by value
+
+// Flags for mpi_register_ex (256): share one mailbox with every thread of
+// the process registered the same way; our messages carry our tgid
+#define MPI_REGISTER_TGID 1
+// Children we fork start unregistered instead of with an empty mailbox
+// and our quota
+#define MPI_REGISTER_NOINHERIT 2
+
+// Operations of mpi_reduce (259): one of the first three or'ed with one of
+// the element types
+#define MPI_SUM 1
+#define MPI_MIN 2
+#define MPI_MAX 3
+#define MPI_INT32 0x10
+#define MPI_INT64 0x20
+#define MPI_FLOAT 0x30
+
+// Wildcards of mpi_receive_tag (261)
+#define MPI_ANY_SOURCE (-1)
+#define MPI_ANY_TAG (-1)
+
+// Operations for mpi_pollset_ctl (248)
+#define MPI_POLLSET_ADD 1
+#define MPI_POLLSET_DEL 2
+
+// Limits on messages queued for a process and its current occupancy, see
+// mpi_quota (253). A limit of 0 means unlimited; with MPI_QUOTA_BLOCK set our
+// sends to a full receiver sleep instead of failing with EAGAIN.
+struct mpi_quota {
+	int max_msgs;
+	long max_bytes;
+	int max_pair_msgs;
+	long max_pair_bytes;
+	int flags;
+	int queued_msgs;
+	long queued_bytes;
+};
+
+#define MPI_QUOTA_BLOCK 1
+
 
 // Wrapper function for the MPI register syscall
 int mpi_register(void)
@@ -30,6 +106,30 @@ int mpi_register(void)
     return (int)res;                // Return the result of the syscall
 }
 
+// Wrapper function for the MPI register syscall with flags
+int mpi_register_ex(int flags)
+{
+    int res;
+    __asm__ (
+        "pushl %%eax;"            // Save the current value of EAX
+        "pushl %%ebx;"            // Save the current value of EBX
+        "movl $256, %%eax;"       // Load syscall number 256 (mpi_register_ex) into EAX
+        "movl %1, %%ebx;"         // Load the first argument (flags) into EBX
+        "int $0x80;"              // Trigger the syscall interrupt
+        "movl %%eax, %0;"         // Move the result from EAX to the variable 'res'
+        "popl %%ebx;"             // Restore the original value of EBX
+        "popl %%eax;"             // Restore the original value of EAX
+        : "=m" (res)              // Output: res holds the result of the syscall
+        : "m" (flags)             // Input: flags
+    );
+    
+    if (res >= (unsigned long)(-125)) { // Check if there was an error
+        errno = -res;              // Set errno to the negative value of the result
+        res = -1;                  // Return -1 to indicate an error
+    }
+    return (int)res;                // Return the result of the syscall
+}
+
 // Wrapper function for the MPI send syscall
 int mpi_send(pid_t pid, char *message, ssize_t message_size)
 {
@@ -60,6 +160,62 @@ int mpi_send(pid_t pid, char *message, ssize_t message_size)
     return (int)res;                // Return the result of the syscall
 }
 
+// Wrapper function for the MPI receive-from-any-sender syscall; the sender's
+// pid is stored in *pid
+int mpi_receive_any(pid_t *pid, char* message, ssize_t message_size)
+{
+    int res;
+    __asm__ (
+        "pushl %%eax;"            // Save the current value of EAX
+        "pushl %%ebx;"            // Save the current value of EBX
+        "pushl %%ecx;"            // Save the current value of ECX
+        "pushl %%edx;"            // Save the current value of EDX
+        "movl $255, %%eax;"       // Load syscall number 255 (mpi_receive_any) into EAX
+        "movl %1, %%ebx;"         // Load the first argument (pid) into EBX
+        "movl %2, %%ecx;"         // Load the second argument (message) into ECX
+        "movl %3, %%edx;"         // Load the third argument (message_size) into EDX
+        "int $0x80;"              // Trigger the syscall interrupt
+        "movl %%eax, %0;"         // Move the result from EAX to the variable 'res'
+        "popl %%edx;"             // Restore the original value of EDX
+        "popl %%ecx;"             // Restore the original value of ECX
+        "popl %%ebx;"             // Restore the original value of EBX
+        "popl %%eax;"             // Restore the original value of EAX
+        : "=m" (res)              // Output: res holds the result of the syscall
+        : "m" (pid), "m" (message), "m"(message_size) // Inputs: pid, message, and message_size
+    );
+    
+    if (res >= (unsigned long)(-125)) { // Check if there was an error
+        errno = -res;              // Set errno to the negative value of the result
+        res = -1;                  // Return -1 to indicate an error
+    }
+    return (int)res;                // Return the result of the syscall
+}
+
+// Wrapper function for the MPI probe syscall: the size of the oldest message
+// from pid, without receiving it
+int mpi_probe(pid_t pid)
+{
+    int res;
+    __asm__ (
+        "pushl %%eax;"            // Save the current value of EAX
+        "pushl %%ebx;"            // Save the current value of EBX
+        "movl $254, %%eax;"       // Load syscall number 254 (mpi_probe) into EAX
+        "movl %1, %%ebx;"         // Load the first argument (pid) into EBX
+        "int $0x80;"              // Trigger the syscall interrupt
+        "movl %%eax, %0;"         // Move the result from EAX to the variable 'res'
+        "popl %%ebx;"             // Restore the original value of EBX
+        "popl %%eax;"             // Restore the original value of EAX
+        : "=m" (res)              // Output: res holds the result of the syscall
+        : "m" (pid)               // Input: pid
+    );
+    
+    if (res >= (unsigned long)(-125)) { // Check if there was an error
+        errno = -res;              // Set errno to the negative value of the result
+        res = -1;                  // Return -1 to indicate an error
+    }
+    return (int)res;                // Return the result of the syscall
+}
+
 // Wrapper function for the MPI receive syscall
 int mpi_receive(pid_t pid, char* message, ssize_t message_size)
 {
@@ -122,4 +278,428 @@ int mpi_poll(struct mpi_poll_entry * poll_pids, int npids, int timeout)
     return (int)res;    
 }
 
+// Wrapper function for the MPI poll syscall with a timespec timeout; NULL
+// waits forever, and on return *timeout holds the time that was left
+int mpi_poll_timed(struct mpi_poll_entry * poll_pids, int npids, struct timespec *timeout)
+{
+    int res;
+    __asm__
+    (
+        "pushl %%eax;"
+        "pushl %%ebx;"
+        "pushl %%ecx;"
+        "pushl %%edx;"
+        "movl $250, %%eax;"
+        "movl %1, %%ebx;"
+        "movl %2, %%ecx;"
+        "movl %3, %%edx;"
+        "int $0x80;"
+        "movl %%eax,%0;"
+        "popl %%edx;"
+        "popl %%ecx;"
+        "popl %%ebx;"
+        "popl %%eax;"
+        : "=m" (res)
+        : "m" (poll_pids) ,"m" (npids) ,"m"(timeout)
+    );
+  
+    if (res >= (unsigned long)(-125))
+    {
+        errno = -res;
+        res = -1;
+    }
+    return (int)res;    
+}
+
+// Wrapper function for the blocking MPI receive syscall; timeout is in
+// milliseconds, 0 does not block and a negative value waits forever
+int mpi_receive_wait(pid_t pid, char* message, ssize_t message_size, long timeout)
+{
+    int res;
+    __asm__ (
+        "pushl %%eax;"            // Save the current value of EAX
+        "pushl %%ebx;"            // Save the current value of EBX
+        "pushl %%ecx;"            // Save the current value of ECX
+        "pushl %%edx;"            // Save the current value of EDX
+        "pushl %%esi;"            // Save the current value of ESI
+        "movl $247, %%eax;"       // Load syscall number 247 (mpi_receive_wait) into EAX
+        "movl %1, %%ebx;"         // Load the first argument (pid) into EBX
+        "movl %2, %%ecx;"         // Load the second argument (message) into ECX
+        "movl %3, %%edx;"         // Load the third argument (message_size) into EDX
+        "movl %4, %%esi;"         // Load the fourth argument (timeout) into ESI
+        "int $0x80;"              // Trigger the syscall interrupt
+        "movl %%eax, %0;"         // Move the result from EAX to the variable 'res'
+        "popl %%esi;"             // Restore the original value of ESI
+        "popl %%edx;"             // Restore the original value of EDX
+        "popl %%ecx;"             // Restore the original value of ECX
+        "popl %%ebx;"             // Restore the original value of EBX
+        "popl %%eax;"             // Restore the original value of EAX
+        : "=m" (res)              // Output: res holds the result of the syscall
+        : "m" (pid), "m" (message), "m"(message_size), "m"(timeout) // Inputs: pid, message, message_size and timeout
+    );
+    
+    if (res >= (unsigned long)(-125)) { // Check if there was an error
+        errno = -res;              // Set errno to the negative value of the result
+        res = -1;                  // Return -1 to indicate an error
+    }
+    return (int)res;                // Return the result of the syscall
+}
+
+// Wrapper function for the MPI poll set control syscall
+int mpi_pollset_ctl(int op, pid_t pid)
+{
+    int res;
+    __asm__ (
+        "pushl %%eax;"            // Save the current value of EAX
+        "pushl %%ebx;"            // Save the current value of EBX
+        "pushl %%ecx;"            // Save the current value of ECX
+        "movl $248, %%eax;"       // Load syscall number 248 (mpi_pollset_ctl) into EAX
+        "movl %1, %%ebx;"         // Load the first argument (op) into EBX
+        "movl %2, %%ecx;"         // Load the second argument (pid) into ECX
+        "int $0x80;"              // Trigger the syscall interrupt
+        "movl %%eax, %0;"         // Move the result from EAX to the variable 'res'
+        "popl %%ecx;"             // Restore the original value of ECX
+        "popl %%ebx;"             // Restore the original value of EBX
+        "popl %%eax;"             // Restore the original value of EAX
+        : "=m" (res)              // Output: res holds the result of the syscall
+        : "m" (op), "m" (pid)     // Inputs: op and pid
+    );
+    
+    if (res >= (unsigned long)(-125)) { // Check if there was an error
+        errno = -res;              // Set errno to the negative value of the result
+        res = -1;                  // Return -1 to indicate an error
+    }
+    return (int)res;                // Return the result of the syscall
+}
+
+// Wrapper function for the MPI poll set wait syscall; timeout is in
+// milliseconds, 0 does not block and a negative value waits forever
+int mpi_pollset_wait(struct mpi_poll_entry *events, int maxevents, long timeout)
+{
+    int res;
+    __asm__ (
+        "pushl %%eax;"            // Save the current value of EAX
+        "pushl %%ebx;"            // Save the current value of EBX
+        "pushl %%ecx;"            // Save the current value of ECX
+        "pushl %%edx;"            // Save the current value of EDX
+        "movl $249, %%eax;"       // Load syscall number 249 (mpi_pollset_wait) into EAX
+        "movl %1, %%ebx;"         // Load the first argument (events) into EBX
+        "movl %2, %%ecx;"         // Load the second argument (maxevents) into ECX
+        "movl %3, %%edx;"         // Load the third argument (timeout) into EDX
+        "int $0x80;"              // Trigger the syscall interrupt
+        "movl %%eax, %0;"         // Move the result from EAX to the variable 'res'
+        "popl %%edx;"             // Restore the original value of EDX
+        "popl %%ecx;"             // Restore the original value of ECX
+        "popl %%ebx;"             // Restore the original value of EBX
+        "popl %%eax;"             // Restore the original value of EAX
+        : "=m" (res)              // Output: res holds the result of the syscall
+        : "m" (events), "m" (maxevents), "m"(timeout) // Inputs: events, maxevents and timeout
+    );
+    
+    if (res >= (unsigned long)(-125)) { // Check if there was an error
+        errno = -res;              // Set errno to the negative value of the result
+        res = -1;                  // Return -1 to indicate an error
+    }
+    return (int)res;                // Return the result of the syscall
+}
+
+// Wrapper function for the vectored MPI send syscall
+int mpi_sendv(struct mpi_iovec *iov, int n)
+{
+    int res;
+    __asm__ (
+        "pushl %%eax;"            // Save the current value of EAX
+        "pushl %%ebx;"            // Save the current value of EBX
+        "pushl %%ecx;"            // Save the current value of ECX
+        "movl $251, %%eax;"       // Load syscall number 251 (mpi_sendv) into EAX
+        "movl %1, %%ebx;"         // Load the first argument (iov) into EBX
+        "movl %2, %%ecx;"         // Load the second argument (n) into ECX
+        "int $0x80;"              // Trigger the syscall interrupt
+        "movl %%eax, %0;"         // Move the result from EAX to the variable 'res'
+        "popl %%ecx;"             // Restore the original value of ECX
+        "popl %%ebx;"             // Restore the original value of EBX
+        "popl %%eax;"             // Restore the original value of EAX
+        : "=m" (res)              // Output: res holds the result of the syscall
+        : "m" (iov), "m" (n)      // Inputs: iov and n
+    );
+    
+    if (res >= (unsigned long)(-125)) { // Check if there was an error
+        errno = -res;              // Set errno to the negative value of the result
+        res = -1;                  // Return -1 to indicate an error
+    }
+    return (int)res;                // Return the result of the syscall
+}
+
+// Wrapper function for the vectored MPI receive syscall
+int mpi_recvv(struct mpi_iovec *iov, int n)
+{
+    int res;
+    __asm__ (
+        "pushl %%eax;"            // Save the current value of EAX
+        "pushl %%ebx;"            // Save the current value of EBX
+        "pushl %%ecx;"            // Save the current value of ECX
+        "movl $252, %%eax;"       // Load syscall number 252 (mpi_recvv) into EAX
+        "movl %1, %%ebx;"         // Load the first argument (iov) into EBX
+        "movl %2, %%ecx;"         // Load the second argument (n) into ECX
+        "int $0x80;"              // Trigger the syscall interrupt
+        "movl %%eax, %0;"         // Move the result from EAX to the variable 'res'
+        "popl %%ecx;"             // Restore the original value of ECX
+        "popl %%ebx;"             // Restore the original value of EBX
+        "popl %%eax;"             // Restore the original value of EAX
+        : "=m" (res)              // Output: res holds the result of the syscall
+        : "m" (iov), "m" (n)      // Inputs: iov and n
+    );
+    
+    if (res >= (unsigned long)(-125)) { // Check if there was an error
+        errno = -res;              // Set errno to the negative value of the result
+        res = -1;                  // Return -1 to indicate an error
+    }
+    return (int)res;                // Return the result of the syscall
+}
+
+// Wrapper function for the MPI broadcast syscall: send message to the n pids
+// in pids, copying it from user space once. Stops at the first pid that
+// cannot be sent to; returns the number of pids sent to
+int mpi_bcast(pid_t *pids, int n, char *message, ssize_t message_size)
+{
+    int res;
+    __asm__ (
+        "pushl %%eax;"            // Save the current value of EAX
+        "pushl %%ebx;"            // Save the current value of EBX
+        "pushl %%ecx;"            // Save the current value of ECX
+        "pushl %%edx;"            // Save the current value of EDX
+        "pushl %%esi;"            // Save the current value of ESI
+        "movl $257, %%eax;"       // Load syscall number 257 (mpi_bcast) into EAX
+        "movl %1, %%ebx;"         // Load the first argument (pids) into EBX
+        "movl %2, %%ecx;"         // Load the second argument (n) into ECX
+        "movl %3, %%edx;"         // Load the third argument (message) into EDX
+        "movl %4, %%esi;"         // Load the fourth argument (message_size) into ESI
+        "int $0x80;"              // Trigger the syscall interrupt
+        "movl %%eax, %0;"         // Move the result from EAX to the variable 'res'
+        "popl %%esi;"             // Restore the original value of ESI
+        "popl %%edx;"             // Restore the original value of EDX
+        "popl %%ecx;"             // Restore the original value of ECX
+        "popl %%ebx;"             // Restore the original value of EBX
+        "popl %%eax;"             // Restore the original value of EAX
+        : "=m" (res)              // Output: res holds the result of the syscall
+        : "m" (pids), "m" (n), "m" (message), "m"(message_size) // Inputs: pids, n, message and message_size
+    );
+    
+    if (res >= (unsigned long)(-125)) { // Check if there was an error
+        errno = -res;              // Set errno to the negative value of the result
+        res = -1;                  // Return -1 to indicate an error
+    }
+    return (int)res;                // Return the result of the syscall
+}
+
+// Wrapper function for the MPI scatter syscall: send the i-th message_size
+// bytes of message to pids[i]; message holds n * message_size bytes. Returns
+// the number of pids sent to, like mpi_bcast
+int mpi_scatter(pid_t *pids, int n, char *message, ssize_t message_size)
+{
+    int res;
+    __asm__ (
+        "pushl %%eax;"            // Save the current value of EAX
+        "pushl %%ebx;"            // Save the current value of EBX
+        "pushl %%ecx;"            // Save the current value of ECX
+        "pushl %%edx;"            // Save the current value of EDX
+        "pushl %%esi;"            // Save the current value of ESI
+        "movl $258, %%eax;"       // Load syscall number 258 (mpi_scatter) into EAX
+        "movl %1, %%ebx;"         // Load the first argument (pids) into EBX
+        "movl %2, %%ecx;"         // Load the second argument (n) into ECX
+        "movl %3, %%edx;"         // Load the third argument (message) into EDX
+        "movl %4, %%esi;"         // Load the fourth argument (message_size) into ESI
+        "int $0x80;"              // Trigger the syscall interrupt
+        "movl %%eax, %0;"         // Move the result from EAX to the variable 'res'
+        "popl %%esi;"             // Restore the original value of ESI
+        "popl %%edx;"             // Restore the original value of EDX
+        "popl %%ecx;"             // Restore the original value of ECX
+        "popl %%ebx;"             // Restore the original value of EBX
+        "popl %%eax;"             // Restore the original value of EAX
+        : "=m" (res)              // Output: res holds the result of the syscall
+        : "m" (pids), "m" (n), "m" (message), "m"(message_size) // Inputs: pids, n, message and message_size
+    );
+    
+    if (res >= (unsigned long)(-125)) { // Check if there was an error
+        errno = -res;              // Set errno to the negative value of the result
+        res = -1;                  // Return -1 to indicate an error
+    }
+    return (int)res;                // Return the result of the syscall
+}
+
+// Wrapper function for the MPI reduce syscall: fold the count elements of
+// buf into the reduction towards root. At the root, wait for the other
+// nranks - 1 ranks and replace buf with the result; nranks is ignored
+// elsewhere.
+int mpi_reduce(pid_t root, int op, void *buf, int count, int nranks)
+{
+    int res;
+    __asm__ (
+        "pushl %%eax;"            // Save the current value of EAX
+        "pushl %%ebx;"            // Save the current value of EBX
+        "pushl %%ecx;"            // Save the current value of ECX
+        "pushl %%edx;"            // Save the current value of EDX
+        "pushl %%esi;"            // Save the current value of ESI
+        "pushl %%edi;"            // Save the current value of EDI
+        "movl $259, %%eax;"       // Load syscall number 259 (mpi_reduce) into EAX
+        "movl %1, %%ebx;"         // Load the first argument (root) into EBX
+        "movl %2, %%ecx;"         // Load the second argument (op) into ECX
+        "movl %3, %%edx;"         // Load the third argument (buf) into EDX
+        "movl %4, %%esi;"         // Load the fourth argument (count) into ESI
+        "movl %5, %%edi;"         // Load the fifth argument (nranks) into EDI
+        "int $0x80;"              // Trigger the syscall interrupt
+        "movl %%eax, %0;"         // Move the result from EAX to the variable 'res'
+        "popl %%edi;"             // Restore the original value of EDI
+        "popl %%esi;"             // Restore the original value of ESI
+        "popl %%edx;"             // Restore the original value of EDX
+        "popl %%ecx;"             // Restore the original value of ECX
+        "popl %%ebx;"             // Restore the original value of EBX
+        "popl %%eax;"             // Restore the original value of EAX
+        : "=m" (res)              // Output: res holds the result of the syscall
+        : "m" (root), "m" (op), "m" (buf), "m" (count), "m" (nranks) // Inputs: root, op, buf, count and nranks
+    );
+    
+    if (res >= (unsigned long)(-125)) { // Check if there was an error
+        errno = -res;              // Set errno to the negative value of the result
+        res = -1;                  // Return -1 to indicate an error
+    }
+    return (int)res;                // Return the result of the syscall
+}
+
+// Wrapper function for the tagged MPI send syscall; tag must not be negative
+int mpi_send_tag(pid_t pid, int tag, char *message, ssize_t message_size)
+{
+    int res;
+    __asm__ (
+        "pushl %%eax;"            // Save the current value of EAX
+        "pushl %%ebx;"            // Save the current value of EBX
+        "pushl %%ecx;"            // Save the current value of ECX
+        "pushl %%edx;"            // Save the current value of EDX
+        "pushl %%esi;"            // Save the current value of ESI
+        "movl $260, %%eax;"       // Load syscall number 260 (mpi_send_tag) into EAX
+        "movl %1, %%ebx;"         // Load the first argument (pid) into EBX
+        "movl %2, %%ecx;"         // Load the second argument (tag) into ECX
+        "movl %3, %%edx;"         // Load the third argument (message) into EDX
+        "movl %4, %%esi;"         // Load the fourth argument (message_size) into ESI
+        "int $0x80;"              // Trigger the syscall interrupt
+        "movl %%eax, %0;"         // Move the result from EAX to the variable 'res'
+        "popl %%esi;"             // Restore the original value of ESI
+        "popl %%edx;"             // Restore the original value of EDX
+        "popl %%ecx;"             // Restore the original value of ECX
+        "popl %%ebx;"             // Restore the original value of EBX
+        "popl %%eax;"             // Restore the original value of EAX
+        : "=m" (res)              // Output: res holds the result of the syscall
+        : "m" (pid), "m" (tag), "m" (message), "m" (message_size) // Inputs: pid, tag, message and message_size
+    );
+    
+    if (res >= (unsigned long)(-125)) { // Check if there was an error
+        errno = -res;              // Set errno to the negative value of the result
+        res = -1;                  // Return -1 to indicate an error
+    }
+    return (int)res;                // Return the result of the syscall
+}
+
+// Wrapper function for the tag-matched MPI receive syscall: receive the
+// oldest message from *pid tagged *tag, either of which may be MPI_ANY_SOURCE
+// or MPI_ANY_TAG; both are replaced by those of the message received
+int mpi_receive_tag(pid_t *pid, int *tag, char* message, ssize_t message_size)
+{
+    int res;
+    __asm__ (
+        "pushl %%eax;"            // Save the current value of EAX
+        "pushl %%ebx;"            // Save the current value of EBX
+        "pushl %%ecx;"            // Save the current value of ECX
+        "pushl %%edx;"            // Save the current value of EDX
+        "pushl %%esi;"            // Save the current value of ESI
+        "movl $261, %%eax;"       // Load syscall number 261 (mpi_receive_tag) into EAX
+        "movl %1, %%ebx;"         // Load the first argument (pid) into EBX
+        "movl %2, %%ecx;"         // Load the second argument (tag) into ECX
+        "movl %3, %%edx;"         // Load the third argument (message) into EDX
+        "movl %4, %%esi;"         // Load the fourth argument (message_size) into ESI
+        "int $0x80;"              // Trigger the syscall interrupt
+        "movl %%eax, %0;"         // Move the result from EAX to the variable 'res'
+        "popl %%esi;"             // Restore the original value of ESI
+        "popl %%edx;"             // Restore the original value of EDX
+        "popl %%ecx;"             // Restore the original value of ECX
+        "popl %%ebx;"             // Restore the original value of EBX
+        "popl %%eax;"             // Restore the original value of EAX
+        : "=m" (res)              // Output: res holds the result of the syscall
+        : "m" (pid), "m" (tag), "m" (message), "m" (message_size) // Inputs: pid, tag, message and message_size
+    );
+    
+    if (res >= (unsigned long)(-125)) { // Check if there was an error
+        errno = -res;              // Set errno to the negative value of the result
+        res = -1;                  // Return -1 to indicate an error
+    }
+    return (int)res;                // Return the result of the syscall
+}
+
+// Wrapper function for the MPI quota syscall; either argument may be NULL
+int mpi_quota(const struct mpi_quota *quota, struct mpi_quota *oquota)
+{
+    int res;
+    __asm__ (
+        "pushl %%eax;"            // Save the current value of EAX
+        "pushl %%ebx;"            // Save the current value of EBX
+        "pushl %%ecx;"            // Save the current value of ECX
+        "movl $253, %%eax;"       // Load syscall number 253 (mpi_quota) into EAX
+        "movl %1, %%ebx;"         // Load the first argument (quota) into EBX
+        "movl %2, %%ecx;"         // Load the second argument (oquota) into ECX
+        "int $0x80;"              // Trigger the syscall interrupt
+        "movl %%eax, %0;"         // Move the result from EAX to the variable 'res'
+        "popl %%ecx;"             // Restore the original value of ECX
+        "popl %%ebx;"             // Restore the original value of EBX
+        "popl %%eax;"             // Restore the original value of EAX
+        : "=m" (res)              // Output: res holds the result of the syscall
+        : "m" (quota), "m" (oquota) // Inputs: quota and oquota
+    );
+    
+    if (res >= (unsigned long)(-125)) { // Check if there was an error
+        errno = -res;              // Set errno to the negative value of the result
+        res = -1;                  // Return -1 to indicate an error
+    }
+    return (int)res;                // Return the result of the syscall
+}
+
+// Map a ring shared with a peer. With create set, make a new ring of at
+// least size bytes for peer; otherwise attach to the ring peer created for
+// us. Returns the header of the mapping, or NULL with errno set.
+struct mpi_ring_header *mpi_ring_map(pid_t peer, unsigned int size, int create)
+{
+    struct mpi_ring_req req;
+    struct mpi_ring_header *header;
+    long page_size = sysconf(_SC_PAGESIZE);
+    int fd, res;
+    size_t length;
+
+    fd = open("/dev/mpi_ring", O_RDWR);
+    if (fd < 0)
+        return NULL;
+
+    if (create) {
+        req.peer = peer;
+        req.size = size;
+        res = ioctl(fd, MPI_RING_CREATE, &req);
+    } else {
+        res = ioctl(fd, MPI_RING_ATTACH, peer);
+    }
+    if (res < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    // Map the header page first to learn the size of the data area
+    header = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    length = page_size + header->size;
+    munmap(header, page_size);
+
+    header = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // The mapping keeps the ring alive
+    return header == MAP_FAILED ? NULL : header;
+}
+
 #endif